@@ -15,49 +15,111 @@ MTFKS: Multi-Threaded File Keyword/Regex Search
 #include <condition_variable>
 
 // Structures, Typing and Algorithms
-#include <queue>
+#include <deque>
+#include <vector>
 #include <optional>
+#include <variant>
+#include <array>
+#include <bitset>
+#include <unordered_map>
+#include <unordered_set>
+#include <string_view>
 #include <functional>
+#include <type_traits>
+#include <iterator>
+#include <memory>
+#include <new>
 #include <algorithm>
 #include <regex>
 
+// POSIX File I/O
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <cctype>
+#include <cstdint>
+#include <sys/resource.h>
+
+// Raw Directory Walking (Linux only)
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+// Asynchronous File Reading (Linux io_uring, driven with raw syscalls)
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define MTFKS_IO_URING 1
+#endif
+
+// SIMD Intrinsics (x86 only, picked at runtime)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MTFKS_X86 1
+#endif
+
 // Define the namespace
 namespace fs = std::filesystem;
 
-// Thread-Safe Queue Implementation
-struct ThreadSafeQueue {
-    // Queue container
-    std::queue<fs::path> q;
+// Batched Thread-Safe Queue Implementation
+// Producers hand over whole blocks of items and consumers take a share of
+// the backlog per lock, so the mutex and wakeups are paid once per block
+// rather than once per path. A non-zero capacity makes push block while full.
+template <typename T>
+struct BatchQueue {
+    // Largest share a single consumer takes per pop
+    static constexpr size_t MAX_POP = 256;
+
+    std::deque<T> q;
     std::mutex m;
-    std::condition_variable cv;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    size_t consumers{1};
+    size_t capacity{0};
     bool finished{false};
 
-    // Push a file path into the queue
-    void push(fs::path p) {
+    explicit BatchQueue(size_t n_consumers, size_t cap = 0)
+        : consumers(std::max<size_t>(1, n_consumers)), capacity(cap) {}
+
+    // Move a whole block of items into the queue, leaving `block` empty
+    void push_batch(std::vector<T>& block) {
+        if (block.empty()) return;
+        size_t n = block.size();
         {
-            // Use a Mutex Lock Guard to ensure no deadlocks occur
-            std::lock_guard<std::mutex> lg(m);
-            q.push(std::move(p));
+            std::unique_lock<std::mutex> ul(m);
+            if (capacity) not_full.wait(ul, [&]{ return q.size() < capacity; });
+            for (auto& item : block) q.push_back(std::move(item));
         }
+        block.clear();
 
-        // Notify a sleeping worker to take up a task
-        cv.notify_one();
+        // One wakeup per block, every idle worker may find a share of a large one
+        if (n == 1) not_empty.notify_one();
+        else not_empty.notify_all();
     }
 
-    // Pop the object in the queue
-    std::optional<fs::path> pop() {
-        // Use a unique lock instead of a lock guard
-        std::unique_lock<std::mutex> ul(m);
-        cv.wait(ul, [&]{ return finished || !q.empty(); });
+    // Pop a fair share of the backlog into `out`, false once finished and drained
+    bool pop_batch(std::vector<T>& out, size_t max = MAX_POP) {
+        out.clear();
+        {
+            std::unique_lock<std::mutex> ul(m);
+            not_empty.wait(ul, [&]{ return finished || !q.empty(); });
+            if (q.empty()) return false;
 
-        // If the queue is empty, return a null object
-        if (q.empty()) return std::nullopt;
-        
-        // Pop from the queue
-        auto path = q.front();
-        q.pop();
+            // Split the backlog across consumers so the tail of a run stays balanced
+            size_t take = std::min({max, q.size(), std::max<size_t>(1, q.size() / consumers)});
+            for (size_t i = 0; i < take; ++i) {
+                out.push_back(std::move(q.front()));
+                q.pop_front();
+            }
+        }
 
-        return path;
+        if (capacity) not_full.notify_all();
+        return true;
     }
 
     // Set the finished conditional flag
@@ -68,110 +130,3918 @@ struct ThreadSafeQueue {
         }
 
         // Notify all workers pre-merge, all tasks have been completed
-        cv.notify_all();
+        not_empty.notify_all();
+    }
+};
+
+// Producer-side buffer that forwards items to a BatchQueue in blocks
+template <typename T>
+struct BatchWriter {
+    static constexpr size_t BLOCK = 256;
+
+    BatchQueue<T>& q;
+    std::vector<T> block;
+
+    explicit BatchWriter(BatchQueue<T>& queue) : q(queue) { block.reserve(BLOCK); }
+    ~BatchWriter() { flush(); }
+
+    void push(T item) {
+        block.push_back(std::move(item));
+        if (block.size() >= BLOCK) flush();
+    }
+
+    void flush() { q.push_batch(block); }
+};
+
+// Ignore Files
+// With --ignore, every directory's .gitignore and .ignore (later wins) are
+// compiled once into an IgnoreRules node chained to its parent's, and
+// children carry the node down, so a directory's patterns are parsed once no
+// matter how many entries they are checked against. Matching follows
+// gitignore: the last matching pattern of the deepest node deciding wins,
+// `!` re-includes, a trailing `/` only matches directories, and a pattern
+// with an inner or leading `/` is anchored to its file's directory. Ignored
+// directories are pruned before they are ever queued.
+struct IgnorePattern {
+    // Glob tokens: STAR never crosses '/', DIRS (from `**/`) matches zero or more whole directories
+    enum Kind : uint8_t { LIT, ANY, SET, STAR, GLOBSTAR, DIRS };
+    struct Token {
+        Kind kind;
+        char c;
+        uint32_t set;
+    };
+
+    // Common shapes are matched without the DP: `name`, `prefix*`, `*.ext`, `dir/**`
+    enum Shape : uint8_t { GENERAL, EXACT, PREFIX, SUFFIX, UNDER };
+
+    std::vector<Token> tokens;
+    std::vector<std::bitset<256>> sets;
+    std::string literal;        // every literal character, in order
+    bool negate{false};
+    bool dir_only{false};
+    bool anchored{false};
+    Shape shape{GENERAL};
+
+    // Parse one gitignore line, false for blanks and comments
+    bool parse(std::string line) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        while (!line.empty() && line.back() == ' ' && !(line.size() > 1 && line[line.size() - 2] == '\\')) line.pop_back();
+        if (line.empty() || line[0] == '#') return false;
+        if (line[0] == '!') {
+            negate = true;
+            line.erase(0, 1);
+        }
+        if (!line.empty() && line.back() == '/') {
+            dir_only = true;
+            line.pop_back();
+        }
+        if (line.empty()) return false;
+
+        anchored = line.find('/') != std::string::npos;
+        if (line[0] == '/') line.erase(0, 1);
+
+        for (size_t i = 0; i < line.size(); ++i) {
+            char c = line[i];
+            if (c == '\\' && i + 1 < line.size()) {
+                tokens.push_back(Token{LIT, line[++i], 0});
+                literal += line[i];
+            } else if (c == '*') {
+                size_t run = 1;
+                while (i + 1 < line.size() && line[i + 1] == '*') ++i, ++run;
+                bool at_start = i + 1 == run || line[i - run] == '/';
+                if (run >= 2 && at_start && i + 1 < line.size() && line[i + 1] == '/') {
+                    tokens.push_back(Token{DIRS, 0, 0});
+                    ++i;
+                } else if (run >= 2 && at_start && i + 1 == line.size()) {
+                    tokens.push_back(Token{GLOBSTAR, 0, 0});
+                } else {
+                    tokens.push_back(Token{STAR, 0, 0});
+                }
+            } else if (c == '?') {
+                tokens.push_back(Token{ANY, 0, 0});
+            } else if (c == '[' && line.find(']', i + 2) != std::string::npos) {
+                std::bitset<256> set;
+                size_t j = i + 1;
+                bool neg = line[j] == '!' || line[j] == '^';
+                if (neg) ++j;
+                for (bool first = true; j < line.size() && (first || line[j] != ']'); first = false) {
+                    unsigned char lo = static_cast<unsigned char>(line[j]), hi = lo;
+                    if (j + 2 < line.size() && line[j + 1] == '-' && line[j + 2] != ']') {
+                        hi = static_cast<unsigned char>(line[j + 2]);
+                        j += 2;
+                    }
+                    for (unsigned b = lo; b <= hi; ++b) set[b] = true;
+                    ++j;
+                }
+                sets.push_back(neg ? ~set : set);
+                tokens.push_back(Token{SET, 0, static_cast<uint32_t>(sets.size() - 1)});
+                i = j;
+            } else {
+                tokens.push_back(Token{LIT, c, 0});
+                literal += c;
+            }
+        }
+
+        // One wildcard at either end of an otherwise literal pattern
+        size_t n_lit = literal.size();
+        if (n_lit == tokens.size()) shape = EXACT;
+        else if (n_lit + 1 == tokens.size() && tokens.back().kind == STAR) shape = PREFIX;
+        else if (n_lit + 1 == tokens.size() && tokens.back().kind == GLOBSTAR) shape = UNDER;
+        else if (n_lit + 1 == tokens.size() && tokens.front().kind == STAR) shape = SUFFIX;
+        return true;
+    }
+
+    static bool slash_free(std::string_view s) { return s.find('/') == std::string_view::npos; }
+
+    // Whole-string glob match, ok[t][i] = tokens from t match text from i
+    bool glob(std::string_view text) const {
+        size_t n = text.size(), n_lit = literal.size();
+        switch (shape) {
+            case EXACT: return text == literal;
+            case PREFIX: return n >= n_lit && text.compare(0, n_lit, literal) == 0 && slash_free(text.substr(n_lit));
+            case UNDER: return n >= n_lit && text.compare(0, n_lit, literal) == 0;
+            case SUFFIX: return n >= n_lit && text.compare(n - n_lit, n_lit, literal) == 0 && slash_free(text.substr(0, n - n_lit));
+            case GENERAL: break;
+        }
+
+        // The table is per-thread scratch, reused across every call
+        thread_local std::vector<char> ok;
+        size_t width = n + 1;
+        ok.assign((tokens.size() + 1) * width, 0);
+        ok[tokens.size() * width + n] = 1;
+        for (size_t t = tokens.size(); t-- > 0;) {
+            const Token& tok = tokens[t];
+            char* cur = &ok[t * width];
+            const char* nxt = &ok[(t + 1) * width];
+            bool dirs_after = false;    // some j > i after a '/' where the rest matches
+            for (size_t i = n + 1; i-- > 0;) {
+                bool can = i < n;
+                unsigned char c = can ? static_cast<unsigned char>(text[i]) : 0;
+                switch (tok.kind) {
+                    case LIT: cur[i] = can && c == static_cast<unsigned char>(tok.c) && nxt[i + 1]; break;
+                    case ANY: cur[i] = can && c != '/' && nxt[i + 1]; break;
+                    case SET: cur[i] = can && c != '/' && sets[tok.set][c] && nxt[i + 1]; break;
+                    case STAR: cur[i] = nxt[i] || (can && c != '/' && cur[i + 1]); break;
+                    case GLOBSTAR: cur[i] = nxt[i] || (can && cur[i + 1]); break;
+                    case DIRS:
+                        if (can && c == '/' && nxt[i + 1]) dirs_after = true;
+                        cur[i] = nxt[i] || dirs_after;
+                        break;
+                }
+            }
+        }
+        return ok[0];
+    }
+
+    // `rel` is the entry's path relative to the ignore file's directory
+    bool matches(std::string_view rel, std::string_view name, bool is_dir) const {
+        if (dir_only && !is_dir) return false;
+        return glob(anchored ? rel : name);
+    }
+};
+
+struct IgnoreRules {
+    std::shared_ptr<const IgnoreRules> parent;
+    std::string base;       // directory the patterns are relative to, as the walker spells it
+    std::vector<IgnorePattern> patterns;
+
+    // Append the patterns of one ignore file, false if it cannot be read
+    bool load(const fs::path& file) {
+        std::ifstream ifs(file);
+        if (!ifs) return false;
+        for (std::string line; std::getline(ifs, line);) {
+            IgnorePattern p;
+            if (p.parse(line)) patterns.push_back(std::move(p));
+        }
+        return true;
+    }
+};
+
+// Rules in effect inside `dir`: its own ignore files layered over the parent's
+std::shared_ptr<const IgnoreRules> enter_directory(const std::shared_ptr<const IgnoreRules>& parent, const std::string& dir) {
+    auto rules = std::make_shared<IgnoreRules>();
+    rules->parent = parent;
+    rules->base = dir;
+    bool any = false;
+    for (const char* name : {".gitignore", ".ignore"}) any |= rules->load(fs::path(dir) / name);
+    if (!any || rules->patterns.empty()) return parent;
+    return rules;
+}
+
+// Whether an entry of `dir` is ignored; nearer rules and later patterns take precedence
+bool is_ignored(const IgnoreRules* rules, const std::string& dir, std::string_view name, bool is_dir) {
+    std::string rel;
+    for (; rules; rules = rules->parent.get()) {
+        rel.clear();
+        size_t at = rules->base.size();
+        while (at < dir.size() && dir[at] == '/') ++at;
+        if (at < dir.size()) {
+            rel.append(dir, at, std::string::npos);
+            rel += '/';
+        }
+        rel.append(name.data(), name.size());
+
+        for (auto p = rules->patterns.rbegin(); p != rules->patterns.rend(); ++p) {
+            if (p->matches(rel, name, is_dir)) return !p->negate;
+        }
+    }
+    return false;
+}
+
+// Scan Task: a directory to expand, a regular file to search, or one part of a large file
+// A task is a trivially copyable handle, the directory it was found in plus
+// the offset of its name in that directory's name arena, so the scheduler
+// moves a few words per entry and the walk allocates nothing per entry.
+struct DirNode;
+struct SplitFile;
+
+struct Task {
+    DirNode* dir{nullptr};
+    uint32_t name{0};
+    bool is_dir{false};
+    SplitFile* split{nullptr};      // set on the part tasks of a split file
+};
+static_assert(std::is_trivially_copyable_v<Task>, "tasks are copied through the scheduler");
+
+// Expanded Directory
+// Holds the names of every entry found in it back to back (NUL-terminated),
+// the ignore rules in effect inside it and, for the raw walker, the
+// descriptor children are opened relative to. Nodes are reference counted
+// by hand, one count per pending child task or child node, and freed (with
+// their descriptor) by whoever drops the last one. Parentless seed nodes
+// hold whole paths as names: the search root, or index candidates.
+struct DirNode {
+    DirNode* parent{nullptr};
+    uint32_t name{0};                           // own name, in the parent's arena
+    int fd{-1};
+    std::string path;                           // full path, only kept when the walker needed it
+    std::string names;
+    std::shared_ptr<const IgnoreRules> ignore;
+    std::atomic<size_t> refs{0};
+
+    DirNode(DirNode* p, uint32_t n, int f = -1) : parent(p), name(n), fd(f) {}
+    DirNode(const DirNode&) = delete;
+    DirNode& operator=(const DirNode&) = delete;
+    ~DirNode() { if (fd >= 0) ::close(fd); }
+
+    // Append an entry's name to the arena and return its task
+    Task add(std::string_view entry, bool is_dir) {
+        Task task{this, static_cast<uint32_t>(names.size()), is_dir};
+        names.append(entry.data(), entry.size());
+        names.push_back('\0');
+        return task;
+    }
+};
+
+// Hand a filled node to its `n` child tasks, or free it when it has none
+bool adopt(DirNode* node, size_t n) {
+    if (n == 0) {
+        delete node;
+        return false;
+    }
+    node->refs.store(n, std::memory_order_relaxed);
+    if (node->parent) node->parent->refs.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Drop one reference, freeing the node (and then maybe its ancestors) on the last
+void release(DirNode* node) {
+    while (node && node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        DirNode* parent = node->parent;
+        delete node;
+        node = parent;
+    }
+}
+
+inline const char* task_name(const Task& t) {
+    return t.dir->names.data() + t.name;
+}
+
+// Append the full path of an entry of `dir`, rebuilt from its ancestors unless cached
+void append_path(std::string& out, const DirNode* dir, uint32_t name) {
+    if (dir->parent) {
+        if (!dir->path.empty()) out += dir->path;
+        else append_path(out, dir->parent, dir->name);
+        if (out.back() != '/') out += '/';
+    }
+    out += dir->names.data() + name;
+}
+
+// Display path of a task
+fs::path task_path(const Task& t) {
+    std::string path;
+    append_path(path, t.dir, t.name);
+    return path;
+}
+
+// Open a task's file, relative to its parent directory's descriptor if it has one
+int open_task(const Task& t, int flags) {
+    if (t.dir->fd >= 0) return ::openat(t.dir->fd, task_name(t), flags | O_CLOEXEC);
+    thread_local std::string path;
+    path.clear();
+    append_path(path, t.dir, t.name);
+    return ::open(path.c_str(), flags | O_CLOEXEC);
+}
+
+// Raised once --max-total matches are reported; walkers and workers stop picking up work
+std::atomic<bool> stop_search{false};
+
+// Drop a part task that will never run (defined with the file splitting)
+void abandon_part(SplitFile* split);
+
+// Work-Stealing Scheduler
+// Every thread owns a deque: it pushes and pops its own work at the back
+// (depth-first, cache-warm) while idle threads steal from the front of
+// others' deques, where the oldest and usually largest subtrees sit.
+// The run ends when the count of outstanding (queued or running) tasks
+// drops to zero, rather than when a single producer says so.
+struct WorkStealingPool {
+    struct Deque {
+        std::mutex m;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Deque>> deques;
+    std::atomic<size_t> outstanding{0};
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> sleepers{0};
+    std::mutex idle_m;
+    std::condition_variable idle_cv;
+
+    explicit WorkStealingPool(size_t n_threads) {
+        for (size_t i = 0; i < n_threads; ++i) deques.push_back(std::make_unique<Deque>());
+    }
+
+    // Tasks abandoned by an early stop still hold their directories (and split files)
+    ~WorkStealingPool() {
+        for (auto& d : deques) {
+            for (auto& task : d->tasks) {
+                if (task.split) abandon_part(task.split);
+                release(task.dir);
+            }
+        }
+    }
+
+    // Push a block of tasks onto a thread's own deque, leaving `block` empty
+    void push_all(size_t self, std::vector<Task>& block) {
+        if (block.empty()) return;
+        size_t n = block.size();
+        outstanding += n;
+        {
+            std::lock_guard<std::mutex> lg(deques[self]->m);
+            for (auto& task : block) deques[self]->tasks.push_back(std::move(task));
+        }
+        queued += n;
+        block.clear();
+
+        // Wake sleeping thieves, taking the lock so a wakeup cannot be lost
+        if (sleepers.load() > 0) {
+            std::lock_guard<std::mutex> lg(idle_m);
+            if (n == 1) idle_cv.notify_one();
+            else idle_cv.notify_all();
+        }
+    }
+
+    // Take a task from the own deque's back, else steal from another's front
+    std::optional<Task> try_pop(size_t self) {
+        for (size_t i = 0; i < deques.size(); ++i) {
+            size_t victim = (self + i) % deques.size();
+            std::lock_guard<std::mutex> lg(deques[victim]->m);
+            auto& tasks = deques[victim]->tasks;
+            if (tasks.empty()) continue;
+
+            Task task;
+            if (victim == self) {
+                task = std::move(tasks.back());
+                tasks.pop_back();
+            } else {
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            --queued;
+            return task;
+        }
+        return std::nullopt;
+    }
+
+    // Block until a task is available, false once every task has completed
+    // or the search was stopped early (queued tasks are then abandoned)
+    bool next(size_t self, Task& out) {
+        while (true) {
+            if (stop_search.load(std::memory_order_relaxed)) {
+                std::lock_guard<std::mutex> lg(idle_m);
+                idle_cv.notify_all();
+                return false;
+            }
+            if (auto task = try_pop(self)) {
+                out = std::move(*task);
+                return true;
+            }
+
+            std::unique_lock<std::mutex> ul(idle_m);
+            ++sleepers;
+            idle_cv.wait(ul, [&]{ return queued.load() > 0 || outstanding.load() == 0 || stop_search.load(); });
+            --sleepers;
+            if (queued.load() == 0 && outstanding.load() == 0) return false;
+        }
+    }
+
+    // Mark a popped task complete, waking everyone when it was the last one
+    void done(const Task& task) {
+        release(task.dir);
+        if (--outstanding == 0) {
+            std::lock_guard<std::mutex> lg(idle_m);
+            idle_cv.notify_all();
+        }
     }
 };
 
-// Atomic Counter for Number of Files
+// Atomic Counters for Number of Files
 std::atomic<size_t> n_files_scanned{0};
+std::atomic<size_t> n_files_matched{0};
 std::mutex out_m;
 
-// Search Implementation (supports keyword or regex)
-bool search_file(const fs::path& p, const std::string& pattern, bool use_regex) {
-    // File Buffer
-    std::ifstream ifs(p, std::ios::binary);
-    if (!ifs) return false;
+// What to do with files that look binary (a NUL byte in their first block)
+enum class BinaryMode { Text, Skip, Report };
 
-    // Seek the size of the file
-    ifs.seekg(0, std::ios::end);
-    std::streamsize size = ifs.tellg();
-    if (size < 0) return false;
+// Run Options (parsed once in main, read-only afterwards)
+struct Options {
+    bool stream{false};
+    bool raw_walk{false};
+    bool tty_output{false};
+    bool lines{false};
+    size_t before{0};
+    size_t after{0};
+    size_t chunk_size{1 << 20};
+    size_t split_size{64 << 20};    // files larger than this are searched in parts of this size, 0 = never
+    fs::path index_path;
+    bool watch{false};
+    size_t max_count{SIZE_MAX};     // matching lines printed per file
+    size_t max_total{SIZE_MAX};     // matching files reported in the whole run
+    BinaryMode binary{BinaryMode::Text};
+    bool ignore{false};             // honor .gitignore/.ignore while walking
+    fs::path ignore_file;           // extra ignore file applied from the root down
+    bool io_uring{false};
+    size_t readers{0};              // with matchers, split workers into a reader/matcher pipeline
+    size_t matchers{0};
+};
 
-    // Copy contents of the file
-    ifs.seekg(0, std::ios::beg);
-    std::string contents(static_cast<size_t>(size), '\0');
+// Claim one of the --max-total slots for a matching file, raising the stop
+// flag once the last one is taken; false means the file must not be reported
+bool claim_match(const Options& opts) {
+    if (opts.max_total == SIZE_MAX) return true;
+    size_t k = ++n_files_matched;
+    if (k >= opts.max_total) stop_search = true;
+    return k <= opts.max_total;
+}
 
-    // If empty, return False
-    if (!ifs.read(&contents[0], size)) return false;
+// Per-Thread Output Buffer
+// Matches collect in a private buffer that is written to stdout in large
+// blocks under out_m, so workers rarely contend and no line forces its own
+// flush. When stdout is a terminal every line is flushed immediately instead.
+struct OutputBuffer {
+    static constexpr size_t FLUSH_AT = 64 * 1024;
 
-    // If we're using regex, parse it
-    if (use_regex) {
-        try {
-            std::regex re(pattern);
-            return std::regex_search(contents, re);
-        } catch (std::regex_error& e) {
-            return false;
+    std::string buf;
+    bool line_flush{false};
+
+    explicit OutputBuffer(bool flush_each_line) : line_flush(flush_each_line) {}
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+    ~OutputBuffer() { flush(); }
+
+    // Append a path in the same quoted form `std::cout << fs::path` prints
+    void add_path(const std::string& path) {
+        append_quoted(path);
+        buf.push_back('\n');
+        end_line();
+    }
+
+    // Append a path followed by the tab-separated patterns that hit in it
+    void add_path(const std::string& path, const std::vector<uint32_t>& ids, const std::vector<std::string>& names) {
+        append_quoted(path);
+        for (uint32_t id : ids) {
+            buf.push_back('\t');
+            buf += names[id];
         }
-    } else {
-        return contents.find(pattern) != std::string::npos;
+        buf.push_back('\n');
+        end_line();
+    }
+
+    void append_quoted(const std::string& s) {
+        buf.push_back('"');
+        for (char c : s) {
+            if (c == '"' || c == '\\') buf.push_back('\\');
+            buf.push_back(c);
+        }
+        buf.push_back('"');
+    }
+
+    // Append a grep-style line record: path:line:column:text for a match,
+    // path-line-text for a context line (column 0)
+    void add_line(const std::string& path, size_t line, size_t column, std::string_view text) {
+        buf += path;
+        buf += column ? ':' : '-';
+        buf += std::to_string(line);
+        if (column) {
+            buf += ':';
+            buf += std::to_string(column);
+        }
+        buf += column ? ':' : '-';
+        buf.append(text.data(), text.size());
+        buf.push_back('\n');
+        end_line();
+    }
+
+    // Stand-in for the lines of a matching binary file
+    void add_binary_match(const std::string& path) {
+        buf += "Binary file ";
+        buf += path;
+        buf += " matches\n";
+        end_line();
+    }
+
+    // Separator between non-adjacent context groups
+    void add_separator() {
+        buf += "--\n";
+        end_line();
+    }
+
+    void end_line() {
+        if (line_flush || buf.size() >= FLUSH_AT) flush();
+    }
+
+    void flush() {
+        if (buf.empty()) return;
+        std::lock_guard<std::mutex> lg(out_m);
+        std::cout.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+        if (line_flush) std::cout.flush();
+        buf.clear();
+    }
+};
+
+// Parse a byte count with an optional K/M/G suffix
+size_t parse_size(const std::string& s) {
+    size_t pos = 0;
+    unsigned long long n = std::stoull(s, &pos);
+    if (pos < s.size()) {
+        switch (std::toupper(static_cast<unsigned char>(s[pos]))) {
+            case 'K': n <<= 10; break;
+            case 'M': n <<= 20; break;
+            case 'G': n <<= 30; break;
+            default: throw std::invalid_argument("bad size " + s);
+        }
+        if (pos + 1 != s.size()) throw std::invalid_argument("bad size " + s);
     }
+    return static_cast<size_t>(n);
 }
 
-// Worker (Consumer)
-void worker(ThreadSafeQueue& q, const std::string& pattern, bool use_regex) {
-    while (true) {
-        // Pop object in queue
-        auto option = q.pop();
-        if (!option.has_value()) break;
-        const auto path = *option;
+// Parse the optional flags following the positional arguments
+Options parse_options(int argc, char** argv, int first) {
+    Options opts;
+    for (int i = first; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::invalid_argument(arg + " needs a value");
+            return argv[++i];
+        };
 
-        // Search the file for the keyword/regex
-        try {
-            if (fs::is_regular_file(path)) {
-                ++n_files_scanned;
-                if (search_file(path, pattern, use_regex)) {
-                    std::lock_guard<std::mutex> lg(out_m);
-                    std::cout << path << std::endl;
+        if (arg == "--stream") opts.stream = true;
+        else if (arg == "--raw-walk") opts.raw_walk = true;
+        else if (arg == "--io-uring") opts.io_uring = true;
+        else if (arg == "--index") opts.index_path = value();
+        else if (arg == "--watch") opts.watch = true;
+        else if (arg == "--lines" || arg == "-n") opts.lines = true;
+        else if (arg == "--before" || arg == "-B") opts.before = std::stoull(value());
+        else if (arg == "--after" || arg == "-A") opts.after = std::stoull(value());
+        else if (arg == "--context" || arg == "-C") opts.before = opts.after = std::stoull(value());
+        else if (arg == "--max-count" || arg == "-m") opts.max_count = std::stoull(value());
+        else if (arg == "--max-total") opts.max_total = std::stoull(value());
+        else if (arg == "--ignore") opts.ignore = true;
+        else if (arg == "--ignore-file") {
+            opts.ignore_file = value();
+            opts.ignore = true;
+        }
+        else if (arg == "--binary") {
+            std::string mode = value();
+            if (mode == "text") opts.binary = BinaryMode::Text;
+            else if (mode == "skip") opts.binary = BinaryMode::Skip;
+            else if (mode == "report") opts.binary = BinaryMode::Report;
+            else throw std::invalid_argument("--binary must be text, skip or report");
+        }
+        else if (arg == "--readers") opts.readers = std::stoull(value());
+        else if (arg == "--matchers") opts.matchers = std::stoull(value());
+        else if (arg == "--chunk-size") opts.chunk_size = parse_size(value());
+        else if (arg == "--split-size") opts.split_size = parse_size(value());
+        else throw std::invalid_argument("unknown option " + arg);
+    }
+
+    if (opts.chunk_size == 0) throw std::invalid_argument("--chunk-size must be positive");
+    if ((opts.before || opts.after) && !opts.lines) opts.lines = true;
+    if ((opts.readers || opts.matchers) && opts.stream) throw std::invalid_argument("--readers/--matchers load whole files, not --stream");
+#ifndef __linux__
+    if (opts.raw_walk) throw std::invalid_argument("--raw-walk needs Linux getdents64");
+    if (opts.watch) throw std::invalid_argument("--watch needs Linux inotify");
+#endif
+#ifndef MTFKS_IO_URING
+    if (opts.io_uring) throw std::invalid_argument("--io-uring needs Linux io_uring headers");
+#endif
+    return opts;
+}
+
+// Literal Search Kernels
+// First-and-last-byte filtering: compare a vector of candidate start bytes
+// against needle[0] and the bytes k-1 further on against needle[k-1], then
+// only memcmp the middle at positions where both agree. The widest kernel
+// the CPU supports is picked once at startup; the rest stay for benchmarks.
+using FindFn = size_t (*)(const char* hay, size_t n, const char* needle, size_t k);
+
+// Scalar fallback (whatever std::string_view::find does on this libstdc++)
+size_t find_scalar(const char* hay, size_t n, const char* needle, size_t k) {
+    return std::string_view(hay, n).find(std::string_view(needle, k));
+}
+
+#ifdef MTFKS_X86
+__attribute__((target("sse2")))
+size_t find_sse2(const char* hay, size_t n, const char* needle, size_t k) {
+    if (k < 2 || n < k) return find_scalar(hay, n, needle, k);
+
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[k - 1]);
+
+    size_t i = 0;
+    for (; i + k - 1 + 16 <= n; i += 16) {
+        __m128i bf = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hay + i));
+        __m128i bl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hay + i + k - 1));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl))));
+
+        while (mask) {
+            unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+            if (std::memcmp(hay + i + bit + 1, needle + 1, k - 2) == 0) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+
+    size_t r = find_scalar(hay + i, n - i, needle, k);
+    return r == std::string_view::npos ? r : i + r;
+}
+
+__attribute__((target("avx2")))
+size_t find_avx2(const char* hay, size_t n, const char* needle, size_t k) {
+    if (k < 2 || n < k) return find_scalar(hay, n, needle, k);
+
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[k - 1]);
+
+    size_t i = 0;
+    for (; i + k - 1 + 32 <= n; i += 32) {
+        __m256i bf = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hay + i));
+        __m256i bl = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hay + i + k - 1));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, bf), _mm256_cmpeq_epi8(last, bl))));
+
+        while (mask) {
+            unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+            if (std::memcmp(hay + i + bit + 1, needle + 1, k - 2) == 0) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+
+    // Finish the tail (shorter than one vector) with the narrower kernel
+    size_t r = find_sse2(hay + i, n - i, needle, k);
+    return r == std::string_view::npos ? r : i + r;
+}
+#endif
+
+// Byte Count Kernels (newline counting for line numbers)
+using CountFn = size_t (*)(const char* p, size_t n, char c);
+
+size_t count_scalar(const char* p, size_t n, char c) {
+    return static_cast<size_t>(std::count(p, p + n, c));
+}
+
+#ifdef MTFKS_X86
+__attribute__((target("avx2,popcnt")))
+size_t count_avx2(const char* p, size_t n, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t total = 0, i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        total += static_cast<size_t>(__builtin_popcount(static_cast<unsigned>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)))));
+    }
+    return total + count_scalar(p + i, n - i, c);
+}
+
+__attribute__((target("sse2")))
+size_t count_sse2(const char* p, size_t n, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t total = 0, i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        total += static_cast<size_t>(__builtin_popcount(static_cast<unsigned>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)))));
+    }
+    return total + count_scalar(p + i, n - i, c);
+}
+#endif
+
+CountFn pick_count_kernel() {
+#ifdef MTFKS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) return count_avx2;
+    if (__builtin_cpu_supports("sse2")) return count_sse2;
+#endif
+    return count_scalar;
+}
+
+const CountFn count_kernel = pick_count_kernel();
+
+// Every find kernel usable on this CPU, widest first
+std::vector<std::pair<const char*, FindFn>> available_find_kernels() {
+    std::vector<std::pair<const char*, FindFn>> kernels;
+#ifdef MTFKS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) kernels.emplace_back("avx2", find_avx2);
+    if (__builtin_cpu_supports("sse2")) kernels.emplace_back("sse2", find_sse2);
+#endif
+    kernels.emplace_back("scalar", find_scalar);
+    return kernels;
+}
+
+// Runtime CPU dispatch, resolved once
+const FindFn find_kernel = available_find_kernels().front().second;
+
+// Find a literal using the dispatched kernel
+inline size_t find_literal(std::string_view hay, std::string_view needle) {
+    return find_kernel(hay.data(), hay.size(), needle.data(), needle.size());
+}
+
+// Last `c` in [p, p + n), or nullptr; memrchr where libc has it
+inline const char* find_last(const char* p, char c, size_t n) {
+#ifdef __GLIBC__
+    return static_cast<const char*>(::memrchr(p, c, n));
+#else
+    for (size_t i = n; i-- > 0;) {
+        if (p[i] == c) return p + i;
+    }
+    return nullptr;
+#endif
+}
+
+// Matcher Engines
+// Every engine exposes `bool search(std::string_view) const`,
+// `std::optional<Match> find(std::string_view, size_t from) const` and
+// `bool search_part(std::string_view, size_t from, size_t to) const` (one
+// part of a split file, see splittable()). Engines are immutable once built,
+// so a single instance is shared read-only by all workers. The worker loop is
+// instantiated per engine, keeping each hot loop branch-free.
+
+// Byte range of one match within a buffer
+struct Match {
+    size_t begin;
+    size_t end;
+};
+
+// Part [from, to) of a split file plus the `overlap` bytes a match starting in it may run on
+inline std::string_view part_view(std::string_view hay, size_t from, size_t to, size_t overlap) {
+    return hay.substr(from, std::min(hay.size(), to + overlap) - from);
+}
+
+// Literals a file must contain to possibly match, as an OR of AND-groups
+// (used to query the trigram index); nullopt means any file may match
+using IndexQuery = std::optional<std::vector<std::vector<std::string>>>;
+
+// Required Literals of a Regex (conservative)
+// Splits an ECMAScript pattern into runs of plain characters that every
+// match must contain. Anything not understood (classes, groups, escapes
+// like \d) just ends the current run and a top-level alternation gives up,
+// so the result is always safe to filter on, if sometimes weaker than it
+// could be.
+IndexQuery regex_required_literals(const std::string& re) {
+    std::vector<std::string> runs;
+    std::string run;
+    size_t n = re.size();
+
+    auto cut = [&] {
+        if (run.size() >= 3) runs.push_back(run);
+        run.clear();
+    };
+    auto skip_class = [&](size_t i) {
+        ++i;
+        if (i < n && re[i] == '^') ++i;
+        while (i < n && re[i] != ']') i += re[i] == '\\' ? 2 : 1;
+        return i + 1;
+    };
+    auto skip_lazy = [&](size_t i) { return i < n && re[i] == '?' ? i + 1 : i; };
+    auto is_hex = [](char h) { return std::isxdigit(static_cast<unsigned char>(h)) != 0; };
+
+    for (size_t i = 0; i < n;) {
+        char c = re[i];
+        switch (c) {
+            case '|':
+                return std::nullopt;
+            case '(': {
+                // Skip the whole group, it may be optional or hold an alternation
+                cut();
+                size_t depth = 0;
+                while (i < n) {
+                    if (re[i] == '\\') { i += 2; continue; }
+                    if (re[i] == '[') { i = skip_class(i); continue; }
+                    if (re[i] == '(') ++depth;
+                    if (re[i] == ')' && --depth == 0) { ++i; break; }
+                    ++i;
                 }
+                continue;
             }
-        } catch (std::exception& e) {
-            std::lock_guard<std::mutex> lg(out_m);
-            std::cerr << "[error]" << path << ":" << e.what() << std::endl;
+            case '[':
+                cut();
+                i = skip_class(i);
+                continue;
+            case '.': case '^': case '$':
+                cut();
+                ++i;
+                continue;
+            case '*': case '?':
+                // The previous character may be absent
+                if (!run.empty()) run.pop_back();
+                cut();
+                i = skip_lazy(i + 1);
+                continue;
+            case '+':
+                cut();
+                i = skip_lazy(i + 1);
+                continue;
+            case '{': {
+                size_t close = re.find('}', i);
+                if (close == std::string::npos || !std::isdigit(static_cast<unsigned char>(re[i + 1]))) break;
+                if (std::stoul(re.substr(i + 1)) == 0 && !run.empty()) run.pop_back();
+                cut();
+                i = skip_lazy(close + 1);
+                continue;
+            }
+            case '\\': {
+                if (i + 1 >= n) { ++i; continue; }
+                char e = re[i + 1];
+                const char* simple = std::strchr("ntrfv", e);
+                if (e != '\0' && simple) {
+                    run += "\n\t\r\f\v"[simple - "ntrfv"];
+                    i += 2;
+                } else if (e == 'x' && i + 3 < n && is_hex(re[i + 2]) && is_hex(re[i + 3])) {
+                    run += static_cast<char>(std::stoi(re.substr(i + 2, 2), nullptr, 16));
+                    i += 4;
+                } else if (std::isalnum(static_cast<unsigned char>(e))) {
+                    // Classes, boundaries, back-references, \u and \c escapes
+                    cut();
+                    i += e == 'c' ? 3 : 2;
+                    while (i < n && std::isalnum(static_cast<unsigned char>(re[i])) && (e == 'u' || std::isdigit(static_cast<unsigned char>(e)))) ++i;
+                } else {
+                    run += e;
+                    i += 2;
+                }
+                continue;
+            }
+            default:
+                break;
         }
+
+        run += c;
+        ++i;
     }
+
+    cut();
+    if (runs.empty()) return std::nullopt;
+    return std::vector<std::vector<std::string>>{runs};
 }
 
-// Main Driver Program (Producer)
-int main(int argc, char** argv) {
-    // Handle arguments
-    if (argc != 5) {
-        std::cerr << "Usage: " << argv[0] << " <keyword|regex> <path> <n_threads> <mode>\n";
-        std::cerr << "mode: 0 = plain keyword, 1 = regex\n";
-        return 2;
+// Plain keyword search (mode 0)
+struct LiteralMatcher {
+    static constexpr bool streamable = true;
+    static constexpr bool reports_patterns = false;
+    std::string needle;
+
+    // Bytes a match can straddle across a chunk boundary
+    size_t overlap() const { return needle.empty() ? 0 : needle.size() - 1; }
+
+    // Any byte offset can end a part, the overlap covers matches across it
+    bool splittable() const { return true; }
+    static constexpr bool split_at_lines = false;
+
+    IndexQuery index_query() const { return std::vector<std::vector<std::string>>{{needle}}; }
+
+    bool search(std::string_view hay) const {
+        return find_literal(hay, needle) != std::string_view::npos;
     }
 
-    fs::path root = argv[2];
-    std::string pattern = argv[1];
-    int num_threads = std::stoi(argv[3]);
-    bool use_regex = std::stoi(argv[4]) != 0;
+    bool search_part(std::string_view hay, size_t from, size_t to) const {
+        return search(part_view(hay, from, to, overlap()));
+    }
 
-    if (num_threads <= 0) num_threads = 1;
+    std::optional<Match> find(std::string_view hay, size_t from) const {
+        size_t at = find_literal(hay.substr(from), needle);
+        if (at == std::string_view::npos) return std::nullopt;
+        return Match{from + at, from + at + needle.size()};
+    }
+};
 
-    // Initialize queue, start the timer
-    ThreadSafeQueue queue;
-    auto t0 = std::chrono::steady_clock::now();
+// Distinct pattern ids hit in the current file
+// Per-thread scratch: every pattern keeps the epoch of the file it was last
+// hit in, so starting a new file is O(1) instead of clearing a bitmap.
+struct HitSet {
+    std::vector<uint32_t> ids;
+    std::vector<uint32_t> stamp;
+    uint32_t epoch{0};
 
-    std::vector<std::thread> threads;
-    for (int i = 0; i < num_threads; ++i)
-        threads.emplace_back(worker, std::ref(queue), std::cref(pattern), use_regex);
+    void reset(size_t n_patterns) {
+        if (stamp.size() < n_patterns) stamp.resize(n_patterns, 0);
+        ++epoch;
+        ids.clear();
+    }
 
-    try {
-        for (auto const& dir_entry : fs::recursive_directory_iterator(root, fs::directory_options::skip_permission_denied)) {
-            try {
-                queue.push(dir_entry.path());
-            } catch (...) {}
+    void add(uint32_t id) {
+        if (stamp[id] == epoch) return;
+        stamp[id] = epoch;
+        ids.push_back(id);
+    }
+};
+
+// Any of many keywords in one pass, read one per line from a pattern file (mode 2)
+// Aho-Corasick automaton compiled to a complete DFA: bytes are mapped to the
+// few equivalence classes the patterns actually use, and transitions live in
+// one flat states x classes table. The top bit of a transition marks states
+// where some pattern ends, so the hot loop is one load and one test per byte.
+struct MultiLiteralMatcher {
+    static constexpr bool streamable = true;
+    static constexpr bool reports_patterns = true;
+    static constexpr uint32_t ACCEPT = 1u << 31;
+    static constexpr uint32_t NONE = ~0u;
+
+    std::vector<std::string> needles;
+    std::array<uint8_t, 256> cls{};
+    size_t n_classes{1};
+    std::vector<uint32_t> table;
+    std::vector<uint32_t> term;    // pattern ending exactly at a state, or NONE
+    std::vector<uint32_t> dict;    // nearest proper suffix state that ends a pattern, or NONE
+    size_t longest{0};
+
+    explicit MultiLiteralMatcher(std::vector<std::string> patterns) : needles(std::move(patterns)) {
+        std::sort(needles.begin(), needles.end());
+        needles.erase(std::unique(needles.begin(), needles.end()), needles.end());
+
+        // Byte classes: class 0 is every byte that appears in no pattern
+        for (auto& n : needles) {
+            longest = std::max(longest, n.size());
+            for (unsigned char c : n) {
+                if (!cls[c]) cls[c] = static_cast<uint8_t>(n_classes++);
+            }
+        }
+
+        // Trie
+        table.assign(n_classes, NONE);
+        term.assign(1, NONE);
+        for (uint32_t id = 0; id < needles.size(); ++id) {
+            uint32_t s = 0;
+            for (unsigned char c : needles[id]) {
+                uint32_t& next = table[s * n_classes + cls[c]];
+                if (next == NONE) {
+                    next = static_cast<uint32_t>(term.size());
+                    term.push_back(NONE);
+                    table.resize(table.size() + n_classes, NONE);
+                }
+                s = table[s * n_classes + cls[c]];
+            }
+            term[s] = id;
+        }
+
+        // Failure links in BFS order, folded into the table to make it a DFA
+        size_t n_states = term.size();
+        std::vector<uint32_t> fail(n_states, 0);
+        dict.assign(n_states, NONE);
+        std::vector<uint32_t> order{0};
+        for (size_t i = 0; i < order.size(); ++i) {
+            uint32_t s = order[i];
+            for (size_t c = 0; c < n_classes; ++c) {
+                uint32_t& next = table[s * n_classes + c];
+                uint32_t via_fail = s ? table[fail[s] * n_classes + c] : 0;
+                if (next == NONE) {
+                    next = via_fail;
+                    continue;
+                }
+                fail[next] = via_fail;
+                dict[next] = term[via_fail] != NONE ? via_fail : dict[via_fail];
+                order.push_back(next);
+            }
+        }
+
+        for (auto& next : table) {
+            if (term[next] != NONE || dict[next] != NONE) next |= ACCEPT;
         }
-    } catch (std::exception& e) {
-        std::cerr << "[walk error]" << e.what() << "\n";
     }
 
-    // All files parsed, end the timer, join all threads too
-    queue.set_finished();
-    for (auto& thread : threads) thread.join();
+    size_t overlap() const { return longest ? longest - 1 : 0; }
 
-    auto t1 = std::chrono::steady_clock::now();
-    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1-t0).count();
-    std::cout << "\nScanned " << n_files_scanned.load() << " files in " << ms <<"ms.\n";
+    bool splittable() const { return true; }
+    static constexpr bool split_at_lines = false;
+
+    // A file is a candidate if it may contain any one of the keywords
+    IndexQuery index_query() const {
+        std::vector<std::vector<std::string>> groups;
+        for (auto& n : needles) groups.push_back({n});
+        return groups;
+    }
+
+    uint32_t step(uint32_t s, unsigned char c) const {
+        return table[(s & ~ACCEPT) * n_classes + cls[c]];
+    }
+
+    // Call `on_hit(pattern id, end offset)` for every pattern ending at state `s`
+    template <typename F>
+    void each_output(uint32_t s, size_t end, F&& on_hit) const {
+        for (s &= ~ACCEPT; s != NONE; s = dict[s]) {
+            if (term[s] != NONE) on_hit(term[s], end);
+        }
+    }
+
+    bool search(std::string_view hay) const {
+        uint32_t s = 0;
+        for (unsigned char c : hay) {
+            s = step(s, c);
+            if (s & ACCEPT) return true;
+        }
+        return false;
+    }
+
+    // Leftmost (then longest) occurrence of any keyword. Once something
+    // matches, scanning only continues while a longer pattern could still
+    // complete a match that begins further left.
+    std::optional<Match> find(std::string_view hay, size_t from) const {
+        std::optional<Match> best;
+        uint32_t s = 0;
+        for (size_t i = from; i < hay.size(); ++i) {
+            if (best && i >= best->begin + longest) break;
+            s = step(s, static_cast<unsigned char>(hay[i]));
+            if (!(s & ACCEPT)) continue;
+
+            each_output(s, i + 1, [&](uint32_t id, size_t end) {
+                Match m{end - needles[id].size(), end};
+                if (!best || m.begin < best->begin || (m.begin == best->begin && m.end > best->end)) best = m;
+            });
+        }
+        return best;
+    }
 
+    // Record every distinct pattern occurring in `hay`
+    void collect(std::string_view hay, HitSet& hits) const {
+        uint32_t s = 0;
+        for (unsigned char c : hay) {
+            s = step(s, c);
+            if (s & ACCEPT) each_output(s, 0, [&](uint32_t id, size_t) { hits.add(id); });
+        }
+    }
+
+    bool search_part(std::string_view hay, size_t from, size_t to) const {
+        return search(part_view(hay, from, to, overlap()));
+    }
+
+    void collect_part(std::string_view hay, size_t from, size_t to, HitSet& hits) const {
+        collect(part_view(hay, from, to, overlap()), hits);
+    }
+};
+
+// Linear-Time Regex Engine
+// Mode 1 patterns compile to a Thompson NFA over bytes. Searching runs a
+// lazily built DFA whose states are sets of NFA program counters, so once a
+// state is cached each byte costs one table lookup. Every thread keeps its
+// own DFA cache; when a cache outgrows REGEX_CACHE_BYTES it is dropped and
+// rebuilt, so memory stays bounded and time stays linear in the input.
+// Backreferences and lookahead are not regular, such patterns fall back to
+// std::regex. Anchors follow std::regex: ^ and $ only match at the ends of
+// the buffer, and `.` matches anything except \n and \r.
+struct RegexUnsupported : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+constexpr size_t REGEX_MAX_INSTS = 1 << 16;
+constexpr size_t REGEX_MAX_DEPTH = 1000;
+constexpr size_t REGEX_CACHE_BYTES = 4 << 20;
+
+using ByteSet = std::bitset<256>;
+
+inline bool is_word_byte(unsigned char c) { return std::isalnum(c) || c == '_'; }
+
+// One NFA instruction; BYTE continues at pc + 1
+struct RegexInst {
+    enum Op : uint8_t { BYTE, SPLIT, JMP, ASSERT, MATCH };
+    enum Assert : uint32_t { BEGIN, END, WORD_BOUNDARY, NOT_WORD_BOUNDARY };
+
+    Op op;
+    uint32_t arg{0};    // BYTE: index into sets, ASSERT: kind
+    uint32_t x{0};      // SPLIT/JMP target
+    uint32_t y{0};      // second SPLIT target
+};
+
+// Parsed pattern tree, compiled once and then discarded
+struct RegexNode {
+    enum Kind { EMPTY, SET, ASSERT, CONCAT, ALT, REPEAT };
+    static constexpr uint32_t INF = ~0u;
+
+    Kind kind{EMPTY};
+    uint32_t arg{0};
+    uint32_t min{0};
+    uint32_t max{0};
+    std::vector<RegexNode> kids;
+    bool lazy{false};       // REPEAT prefers fewer iterations
+};
+
+// Recursive-descent parser for the ECMAScript subset that is regular
+struct RegexParser {
+    const std::string& re;
+    std::vector<ByteSet>& sets;
+    size_t i{0};
+    size_t depth{0};
+
+    [[noreturn]] void fail(const std::string& what) const {
+        throw std::invalid_argument(what + " at offset " + std::to_string(i) + " in regex");
+    }
+
+    bool more() const { return i < re.size(); }
+    unsigned char peek() const { return static_cast<unsigned char>(re[i]); }
+
+    RegexNode set_node(const ByteSet& s) {
+        sets.push_back(s);
+        return RegexNode{RegexNode::SET, static_cast<uint32_t>(sets.size() - 1), 0, 0, {}};
+    }
+
+    static ByteSet class_set(char c) {
+        ByteSet s;
+        for (int b = 0; b < 256; ++b) {
+            bool in = c == 'd' || c == 'D' ? std::isdigit(b) != 0
+                    : c == 'w' || c == 'W' ? is_word_byte(static_cast<unsigned char>(b))
+                    : std::isspace(b) != 0;
+            s[b] = in;
+        }
+        return std::isupper(static_cast<unsigned char>(c)) ? ~s : s;
+    }
+
+    unsigned hex(size_t digits) {
+        unsigned v = 0;
+        for (size_t k = 0; k < digits; ++k, ++i) {
+            if (!more() || !std::isxdigit(peek())) fail("bad hex escape");
+            v = v * 16 + static_cast<unsigned>(std::isdigit(peek()) ? peek() - '0' : std::tolower(peek()) - 'a' + 10);
+        }
+        return v;
+    }
+
+    // Escape after the backslash, as a byte; class escapes are handled by the callers
+    unsigned char escaped_byte(bool in_class) {
+        unsigned char c = peek();
+        ++i;
+        switch (c) {
+            case 't': return '\t';
+            case 'n': return '\n';
+            case 'r': return '\r';
+            case 'f': return '\f';
+            case 'v': return '\v';
+            case '0': return '\0';
+            case 'b': if (in_class) return '\b'; break;
+            case 'x': return static_cast<unsigned char>(hex(2));
+            case 'u': {
+                unsigned v = hex(4);
+                if (v > 0xff) throw RegexUnsupported("\\u escape beyond one byte");
+                return static_cast<unsigned char>(v);
+            }
+            case 'c':
+                if (!more() || !std::isalpha(peek())) fail("bad control escape");
+                return static_cast<unsigned char>(re[i++] % 32);
+            default:
+                break;
+        }
+        if (c >= '1' && c <= '9') throw RegexUnsupported("backreference");
+        return c;
+    }
+
+    RegexNode parse_class() {
+        ++i;    // '['
+        bool negate = more() && peek() == '^';
+        if (negate) ++i;
+
+        ByteSet s;
+        while (true) {
+            if (!more()) fail("unterminated character class");
+            if (peek() == ']') break;
+
+            // Either a class escape, or the low end of a possible range
+            int lo;
+            if (peek() == '\\') {
+                ++i;
+                if (!more()) fail("trailing backslash");
+                if (std::strchr("dDwWsS", peek())) {
+                    s |= class_set(re[i++]);
+                    continue;
+                }
+                lo = escaped_byte(true);
+            } else {
+                lo = re[i++] & 0xff;
+            }
+
+            int hi = lo;
+            if (i + 1 < re.size() && peek() == '-' && re[i + 1] != ']') {
+                ++i;
+                if (peek() == '\\') {
+                    ++i;
+                    if (!more() || std::strchr("dDwWsS", peek())) fail("bad range in character class");
+                    hi = escaped_byte(true);
+                } else {
+                    hi = re[i++] & 0xff;
+                }
+                if (hi < lo) fail("bad range in character class");
+            }
+            for (int b = lo; b <= hi; ++b) s[b] = true;
+        }
+        ++i;    // ']'
+        return set_node(negate ? ~s : s);
+    }
+
+    RegexNode parse_atom() {
+        unsigned char c = peek();
+        switch (c) {
+            case '(': {
+                ++i;
+                if (more() && peek() == '?') {
+                    if (i + 1 < re.size() && re[i + 1] == ':') i += 2;
+                    else throw RegexUnsupported("lookahead");
+                }
+                if (++depth > REGEX_MAX_DEPTH) fail("regex nested too deeply");
+                RegexNode inner = parse_alt();
+                --depth;
+                if (!more() || peek() != ')') fail("unbalanced parenthesis");
+                ++i;
+                return inner;
+            }
+            case '[':
+                return parse_class();
+            case '.': {
+                ++i;
+                ByteSet s;
+                s.set();
+                s['\n'] = s['\r'] = false;
+                return set_node(s);
+            }
+            case '^':
+            case '$':
+                ++i;
+                return RegexNode{RegexNode::ASSERT, c == '^' ? RegexInst::BEGIN : RegexInst::END, 0, 0, {}};
+            case '\\': {
+                ++i;
+                if (!more()) fail("trailing backslash");
+                if (peek() == 'b' || peek() == 'B') {
+                    bool word = re[i++] == 'b';
+                    return RegexNode{RegexNode::ASSERT, word ? RegexInst::WORD_BOUNDARY : RegexInst::NOT_WORD_BOUNDARY, 0, 0, {}};
+                }
+                if (std::strchr("dDwWsS", peek())) return set_node(class_set(re[i++]));
+                ByteSet s;
+                s[escaped_byte(false)] = true;
+                return set_node(s);
+            }
+            case '*': case '+': case '?': case '{': case ')':
+                fail("nothing to repeat");
+            default: {
+                ++i;
+                ByteSet s;
+                s[c] = true;
+                return set_node(s);
+            }
+        }
+    }
+
+    // {n}, {n,} or {n,m}; the position is on '{'
+    void parse_braces(uint32_t& min, uint32_t& max) {
+        auto number = [&] {
+            if (!more() || !std::isdigit(peek())) fail("bad repetition count");
+            uint64_t v = 0;
+            while (more() && std::isdigit(peek())) v = std::min<uint64_t>(v * 10 + (re[i++] - '0'), REGEX_MAX_INSTS);
+            return static_cast<uint32_t>(v);
+        };
+        ++i;
+        min = max = number();
+        if (more() && peek() == ',') {
+            ++i;
+            max = more() && peek() == '}' ? RegexNode::INF : number();
+        }
+        if (!more() || peek() != '}' || max < min) fail("bad repetition count");
+        ++i;
+    }
+
+    RegexNode parse_repeat() {
+        RegexNode atom = parse_atom();
+        if (!more() || !std::strchr("*+?{", peek())) return atom;
+        if (atom.kind == RegexNode::ASSERT) fail("nothing to repeat");
+
+        uint32_t min = 0, max = RegexNode::INF;
+        if (peek() == '{') {
+            parse_braces(min, max);
+        } else {
+            min = peek() == '+';
+            max = peek() == '?' ? 1 : RegexNode::INF;
+            ++i;
+        }
+        bool lazy = more() && peek() == '?';
+        if (lazy) ++i;
+        if (more() && std::strchr("*+?{", peek())) fail("nothing to repeat");
+
+        RegexNode node{RegexNode::REPEAT, 0, min, max, {}};
+        node.kids.push_back(std::move(atom));
+        node.lazy = lazy;
+        return node;
+    }
+
+    RegexNode parse_concat() {
+        RegexNode node{RegexNode::CONCAT, 0, 0, 0, {}};
+        while (more() && peek() != '|' && peek() != ')') node.kids.push_back(parse_repeat());
+        return node;
+    }
+
+    RegexNode parse_alt() {
+        RegexNode node{RegexNode::ALT, 0, 0, 0, {}};
+        node.kids.push_back(parse_concat());
+        while (more() && peek() == '|') {
+            ++i;
+            node.kids.push_back(parse_concat());
+        }
+        return node;
+    }
+};
+
+// Compiled program shared read-only by every thread
+struct RegexProgram {
+    std::vector<RegexInst> insts;
+    std::vector<ByteSet> sets;
+    std::array<uint8_t, 256> cls{};     // byte -> equivalence class for DFA transitions
+    uint32_t n_classes{0};
+    bool newline_free{true};            // no match can span a '\n'
+    uint64_t serial;                    // tells per-thread caches of different programs apart
+
+    explicit RegexProgram(const std::string& pattern) {
+        static std::atomic<uint64_t> next_serial{1};
+        serial = next_serial++;
+
+        RegexParser parser{pattern, sets};
+        RegexNode root = parser.parse_alt();
+        if (parser.more()) parser.fail("unbalanced parenthesis");
+
+        emit(root);
+        insts.push_back(RegexInst{RegexInst::MATCH});
+
+        // Bytes that no set (nor \b) tells apart share a DFA column
+        ByteSet word;
+        for (int b = 0; b < 256; ++b) word[b] = is_word_byte(static_cast<unsigned char>(b));
+        std::vector<ByteSet> splits = sets;
+        splits.push_back(word);
+        for (auto& s : sets) newline_free &= !s['\n'];
+
+        std::vector<std::vector<bool>> seen_rows;
+        std::vector<std::vector<bool>> rows(256);
+        for (int b = 0; b < 256; ++b) {
+            for (auto& s : splits) rows[b].push_back(s[b]);
+            auto it = std::find(seen_rows.begin(), seen_rows.end(), rows[b]);
+            cls[b] = static_cast<uint8_t>(it - seen_rows.begin());
+            if (it == seen_rows.end()) seen_rows.push_back(rows[b]);
+        }
+        n_classes = static_cast<uint32_t>(seen_rows.size());
+    }
+
+    uint32_t push(RegexInst inst) {
+        if (insts.size() >= REGEX_MAX_INSTS) throw std::invalid_argument("regex too large");
+        insts.push_back(inst);
+        return static_cast<uint32_t>(insts.size() - 1);
+    }
+
+    void emit(const RegexNode& n) {
+        switch (n.kind) {
+            case RegexNode::EMPTY:
+                break;
+            case RegexNode::SET:
+                push(RegexInst{RegexInst::BYTE, n.arg});
+                break;
+            case RegexNode::ASSERT:
+                push(RegexInst{RegexInst::ASSERT, n.arg});
+                break;
+            case RegexNode::CONCAT:
+                for (auto& kid : n.kids) emit(kid);
+                break;
+            case RegexNode::ALT: {
+                // SPLIT kid, next-split ... each branch jumps past the rest
+                std::vector<uint32_t> jumps;
+                for (size_t k = 0; k + 1 < n.kids.size(); ++k) {
+                    uint32_t split = push(RegexInst{RegexInst::SPLIT});
+                    insts[split].x = split + 1;
+                    emit(n.kids[k]);
+                    jumps.push_back(push(RegexInst{RegexInst::JMP}));
+                    insts[split].y = static_cast<uint32_t>(insts.size());
+                }
+                emit(n.kids.back());
+                for (uint32_t j : jumps) insts[j].x = static_cast<uint32_t>(insts.size());
+                break;
+            }
+            case RegexNode::REPEAT: {
+                // SPLIT x is the preferred branch: another iteration, or the exit if lazy
+                for (uint32_t k = 0; k < n.min; ++k) emit(n.kids[0]);
+                std::vector<uint32_t> splits;
+                if (n.max == RegexNode::INF) {
+                    uint32_t loop = push(RegexInst{RegexInst::SPLIT});
+                    splits.push_back(loop);
+                    insts[loop].x = loop + 1;
+                    emit(n.kids[0]);
+                    push(RegexInst{RegexInst::JMP, 0, loop});
+                } else {
+                    for (uint32_t k = n.min; k < n.max; ++k) {
+                        splits.push_back(push(RegexInst{RegexInst::SPLIT}));
+                        insts[splits.back()].x = splits.back() + 1;
+                        emit(n.kids[0]);
+                    }
+                }
+                for (uint32_t s : splits) {
+                    insts[s].y = static_cast<uint32_t>(insts.size());
+                    if (n.lazy) std::swap(insts[s].x, insts[s].y);
+                }
+                break;
+            }
+        }
+    }
+
+    // Context of a position: 0 at the buffer ends, 1 next to a word byte, 2 otherwise
+    static uint8_t before(std::string_view hay, size_t at) {
+        return at == 0 ? 0 : is_word_byte(static_cast<unsigned char>(hay[at - 1])) ? 1 : 2;
+    }
+    static uint8_t after(std::string_view hay, size_t at) {
+        return at == hay.size() ? 0 : is_word_byte(static_cast<unsigned char>(hay[at])) ? 1 : 2;
+    }
+
+    static bool holds(uint32_t kind, uint8_t prev, uint8_t next) {
+        switch (kind) {
+            case RegexInst::BEGIN: return prev == 0;
+            case RegexInst::END: return next == 0;
+            case RegexInst::WORD_BOUNDARY: return (prev == 1) != (next == 1);
+            default: return (prev == 1) == (next == 1);
+        }
+    }
+};
+
+// Per-thread matching state for one program: the lazy DFA and Pike VM scratch
+struct RegexCache {
+    static constexpr uint32_t UNKNOWN = ~0u;
+    static constexpr uint32_t MATCHED = 1u << 31;   // a match ends before the byte taken
+
+    const RegexProgram* prog{nullptr};
+    uint64_t serial{0};
+
+    // DFA state key: context byte of the previous position, then the sorted pcs
+    // reached by consuming it (the start pc is added back in every closure)
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<std::string> keys;
+    std::vector<uint32_t> trans;
+    size_t bytes{0};
+    size_t resets{0};
+
+    // Closure scratch
+    std::vector<uint32_t> mark;
+    uint32_t gen{0};
+    std::vector<uint32_t> stack;
+
+    void bind(const RegexProgram& p) {
+        prog = &p;
+        if (serial == p.serial) return;
+        serial = p.serial;
+        reset();
+        mark.assign(p.insts.size(), 0);
+        gen = 0;
+    }
+
+    void reset() {
+        ids.clear();
+        keys.clear();
+        trans.clear();
+        bytes = 0;
+        ++resets;
+    }
+
+    uint32_t next_gen() {
+        if (++gen == 0) {
+            std::fill(mark.begin(), mark.end(), 0);
+            gen = 1;
+        }
+        return gen;
+    }
+
+    // Follow SPLIT/JMP/ASSERT from pc, calling visit(pc) for each BYTE or MATCH reached
+    template <typename Visit>
+    void close(uint32_t pc, uint8_t prev, uint8_t next, Visit&& visit) {
+        stack.push_back(pc);
+        while (!stack.empty()) {
+            uint32_t at = stack.back();
+            stack.pop_back();
+            if (mark[at] == gen) continue;
+            mark[at] = gen;
+
+            const RegexInst& inst = prog->insts[at];
+            switch (inst.op) {
+                case RegexInst::SPLIT:
+                    stack.push_back(inst.y);
+                    stack.push_back(inst.x);
+                    break;
+                case RegexInst::JMP:
+                    stack.push_back(inst.x);
+                    break;
+                case RegexInst::ASSERT:
+                    if (RegexProgram::holds(inst.arg, prev, next)) stack.push_back(at + 1);
+                    break;
+                default:
+                    visit(at);
+                    break;
+            }
+        }
+    }
+
+    uint32_t intern(std::string key) {
+        auto it = ids.find(key);
+        if (it != ids.end()) return it->second;
+
+        // Drop everything once the cache is full; callers only hold the returned id
+        if (bytes > REGEX_CACHE_BYTES) reset();
+        uint32_t id = static_cast<uint32_t>(keys.size());
+        bytes += 2 * key.size() + prog->n_classes * sizeof(uint32_t) + 64;
+        ids.emplace(key, id);
+        keys.push_back(std::move(key));
+        trans.resize(trans.size() + prog->n_classes, UNKNOWN);
+        return id;
+    }
+
+    uint32_t start(uint8_t prev) { return intern(std::string(1, static_cast<char>(prev))); }
+
+    // Closure of a state for the given next context; returns whether it holds a MATCH
+    template <typename Visit>
+    bool close_state(const std::string& key, uint8_t next, Visit&& visit) {
+        uint8_t prev = static_cast<uint8_t>(key[0]);
+        bool matched = false;
+        auto each = [&](uint32_t pc) {
+            if (prog->insts[pc].op == RegexInst::MATCH) matched = true;
+            else visit(pc);
+        };
+        next_gen();
+        for (size_t k = 1; k < key.size(); k += 4) {
+            uint32_t pc;
+            std::memcpy(&pc, key.data() + k, 4);
+            close(pc, prev, next, each);
+        }
+        close(0, prev, next, each);
+        return matched;
+    }
+
+    uint32_t transition(uint32_t s, unsigned char c) {
+        uint8_t next = is_word_byte(c) ? 1 : 2;
+        std::vector<uint32_t> pcs;
+        bool matched = close_state(keys[s], next, [&](uint32_t pc) {
+            if (prog->sets[prog->insts[pc].arg][c]) pcs.push_back(pc + 1);
+        });
+        std::sort(pcs.begin(), pcs.end());
+
+        std::string key(1, static_cast<char>(next));
+        key.resize(1 + 4 * pcs.size());
+        if (!pcs.empty()) std::memcpy(&key[1], pcs.data(), 4 * pcs.size());
+
+        // Only cache the edge if interning did not just drop `s` along with everything else
+        size_t slot = static_cast<size_t>(s) * prog->n_classes + prog->cls[c];
+        size_t epoch = resets;
+        uint32_t t = intern(std::move(key)) | (matched ? MATCHED : 0);
+        if (epoch == resets) trans[slot] = t;
+        return t;
+    }
+
+    // Whether a match ends where the scan stops, given what follows that position
+    bool matches_before(uint32_t s, uint8_t next) {
+        return close_state(keys[s], next, [](uint32_t) {});
+    }
+
+    // End of the earliest-ending match within [from, to); anchors and word
+    // boundaries still see the bytes around the range
+    std::optional<size_t> first_end(std::string_view hay, size_t from, size_t to) {
+        auto* p = reinterpret_cast<const unsigned char*>(hay.data());
+        uint32_t s = start(RegexProgram::before(hay, from));
+        for (size_t i = from; i < to; ++i) {
+            uint32_t t = trans[static_cast<size_t>(s) * prog->n_classes + prog->cls[p[i]]];
+            if (t == UNKNOWN) t = transition(s, p[i]);
+            if (t & MATCHED) return i;
+            s = t;
+        }
+        if (matches_before(s, RegexProgram::after(hay, to))) return to;
+        return std::nullopt;
+    }
+
+    // Leftmost-first match at or after `from` (Pike VM, threads ordered by
+    // start, then by the pattern's priority, so `end` is what ECMAScript picks)
+    std::optional<Match> leftmost(std::string_view hay, size_t from) {
+        struct Thread {
+            uint32_t pc;
+            size_t start;
+        };
+        std::vector<Thread> cur, nxt;
+        std::optional<Match> best;
+
+        auto add = [&](std::vector<Thread>& list, uint32_t pc, size_t start, size_t at) {
+            close(pc, RegexProgram::before(hay, at), RegexProgram::after(hay, at),
+                  [&](uint32_t reached) { list.push_back(Thread{reached, start}); });
+        };
+
+        next_gen();
+        for (size_t i = from;; ++i) {
+            // The new thread starts last, so earlier starts win every tie on a pc
+            if (!best) add(cur, 0, i, i);
+
+            next_gen();
+            for (const Thread& t : cur) {
+                const RegexInst& inst = prog->insts[t.pc];
+                if (inst.op == RegexInst::MATCH) {
+                    // Threads ahead of this one still run and may end later;
+                    // the ones behind it have lower priority and are cut
+                    best = Match{t.start, i};
+                    break;
+                }
+                if (i < hay.size() && prog->sets[inst.arg][static_cast<unsigned char>(hay[i])]) add(nxt, t.pc + 1, t.start, i + 1);
+            }
+
+            cur.swap(nxt);
+            nxt.clear();
+            if (i >= hay.size() || (best && cur.empty())) break;
+        }
+        return best;
+    }
+};
+
+// ECMAScript regex search (mode 1), matches are unbounded so it never streams
+// A literal every match must contain is searched for first with the SIMD
+// kernel. Files without it are rejected at literal speed, and when no match
+// can span lines the automaton only runs over the lines holding it.
+struct RegexMatcher {
+    static constexpr bool streamable = false;
+    static constexpr bool reports_patterns = false;
+    std::string pattern;
+    std::string required;                   // longest required literal, empty if none is known
+    std::optional<RegexProgram> program;    // nullopt: the pattern needs the std::regex fallback
+    std::regex fallback;
+
+    explicit RegexMatcher(std::string re) : pattern(std::move(re)) {
+        try {
+            program.emplace(pattern);
+        } catch (RegexUnsupported&) {
+            fallback = std::regex(pattern, std::regex::ECMAScript | std::regex::optimize);
+        }
+
+        IndexQuery literals = regex_required_literals(pattern);
+        if (literals && literals->size() == 1) {
+            for (auto& lit : literals->front()) {
+                if (lit.size() > required.size()) required = lit;
+            }
+        }
+    }
+
+    IndexQuery index_query() const { return regex_required_literals(pattern); }
+
+    // The calling thread's DFA cache, rebuilt whenever it last served another program
+    static RegexCache& cache(const RegexProgram& prog) {
+        thread_local RegexCache c;
+        c.bind(prog);
+        return c;
+    }
+
+    bool lines_prefilter() const { return program && program->newline_free && !required.empty(); }
+
+    // Parts of a split file are whole lines, so only patterns that cannot
+    // match across a newline split; anchors still see the real file ends
+    bool splittable() const { return program && program->newline_free; }
+    static constexpr bool split_at_lines = true;
+
+    // Line around the next occurrence of the required literal in [from, to)
+    std::optional<std::pair<size_t, size_t>> candidate_line(std::string_view hay, size_t from, size_t to) const {
+        size_t at = find_literal(hay.substr(from, to - from), required);
+        if (at == std::string_view::npos) return std::nullopt;
+        at += from;
+        auto* nl = find_last(hay.data() + from, '\n', at - from);
+        size_t begin = nl ? static_cast<size_t>(nl - hay.data()) + 1 : from;
+        auto* end = static_cast<const char*>(std::memchr(hay.data() + at, '\n', to - at));
+        return std::make_pair(begin, end ? static_cast<size_t>(end - hay.data()) : to);
+    }
+
+    bool search(std::string_view hay) const {
+        if (!program) {
+            if (!required.empty() && find_literal(hay, required) == std::string_view::npos) return false;
+            return std::regex_search(hay.begin(), hay.end(), fallback);
+        }
+        return search_part(hay, 0, hay.size());
+    }
+
+    // Matches within [from, to) of `hay`, which must hold whole lines unless it is all of it
+    bool search_part(std::string_view hay, size_t from, size_t to) const {
+        if (!required.empty() && find_literal(hay.substr(from, to - from), required) == std::string_view::npos) return false;
+
+        auto& c = cache(*program);
+        if (!lines_prefilter()) return c.first_end(hay, from, to).has_value();
+        for (size_t pos = from; pos < to;) {
+            auto line = candidate_line(hay, pos, to);
+            if (!line) return false;
+            if (c.first_end(hay, line->first, line->second)) return true;
+            pos = line->second + 1;
+        }
+        return false;
+    }
+
+    // The DFA finds where the earliest match ends; the Pike VM then only has
+    // to run from the start of that line when no match can cross a newline
+    std::optional<Match> find(std::string_view hay, size_t from) const {
+        if (!required.empty() && find_literal(hay.substr(from), required) == std::string_view::npos) return std::nullopt;
+        if (!program) {
+            std::match_results<std::string_view::const_iterator> m;
+            auto flags = from ? std::regex_constants::match_prev_avail : std::regex_constants::match_default;
+            if (!std::regex_search(hay.begin() + from, hay.end(), m, fallback, flags)) return std::nullopt;
+            size_t begin = from + static_cast<size_t>(m.position(0));
+            return Match{begin, begin + static_cast<size_t>(m.length(0))};
+        }
+
+        auto& c = cache(*program);
+        if (lines_prefilter()) {
+            for (size_t pos = from; pos < hay.size();) {
+                auto line = candidate_line(hay, pos, hay.size());
+                if (!line) return std::nullopt;
+                if (c.first_end(hay, line->first, line->second)) return c.leftmost(hay, line->first);
+                pos = line->second + 1;
+            }
+            return std::nullopt;
+        }
+
+        auto end = c.first_end(hay, from, hay.size());
+        if (!end) return std::nullopt;
+        size_t start = from;
+        if (program->newline_free && *end > from) {
+            auto* nl = find_last(hay.data() + from, '\n', *end - from);
+            if (nl) start = static_cast<size_t>(nl - hay.data()) + 1;
+        }
+        return c.leftmost(hay, start);
+    }
+};
+
+// Adding an engine means adding it here and to make_matcher below
+using Matcher = std::variant<LiteralMatcher, MultiLiteralMatcher, RegexMatcher>;
+
+// Read a pattern file, one keyword per line (blank lines are ignored)
+std::vector<std::string> read_pattern_file(const fs::path& p) {
+    std::ifstream ifs(p);
+    if (!ifs) throw std::runtime_error("cannot open pattern file " + p.string());
+
+    std::vector<std::string> patterns;
+    for (std::string line; std::getline(ifs, line);) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty()) patterns.push_back(std::move(line));
+    }
+
+    if (patterns.empty()) throw std::runtime_error("no patterns in " + p.string());
+    return patterns;
+}
+
+// Validate and build the engine for a mode once, throws on an invalid pattern
+Matcher make_matcher(const std::string& pattern, int mode) {
+    switch (mode) {
+        case 0: return LiteralMatcher{pattern};
+        case 1: return RegexMatcher(pattern);
+        case 2: return MultiLiteralMatcher(read_pattern_file(pattern));
+        default: throw std::invalid_argument("unknown mode " + std::to_string(mode));
+    }
+}
+
+// Files at least this large are memory-mapped, smaller ones are read into a buffer
+constexpr size_t MMAP_THRESHOLD = 64 * 1024;
+
+// Owned file descriptor, closed on scope exit
+struct UniqueFd {
+    int fd{-1};
+
+    explicit UniqueFd(int f) : fd(f) {}
+    UniqueFd(const UniqueFd&) = delete;
+    UniqueFd& operator=(const UniqueFd&) = delete;
+    ~UniqueFd() { if (fd >= 0) ::close(fd); }
+};
+
+// Read-only mapping of a whole file, unmapped on scope exit
+struct MappedFile {
+    void* addr{MAP_FAILED};
+    size_t size{0};
+
+    MappedFile(int fd, size_t n) : size(n) {
+        addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        // We stream through the file exactly once, let the kernel read ahead aggressively
+        if (addr != MAP_FAILED) ::madvise(addr, size, MADV_SEQUENTIAL);
+    }
+    MappedFile(MappedFile&& other) noexcept : addr(other.addr), size(other.size) { other.addr = MAP_FAILED; }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { if (addr != MAP_FAILED) ::munmap(addr, size); }
+
+    bool ok() const { return addr != MAP_FAILED; }
+    std::string_view view() const { return {static_cast<const char*>(addr), size}; }
+};
+
+// Read from a descriptor until `n` bytes or EOF, returns the bytes read or -1
+ssize_t read_full(int fd, char* buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t r = ::read(fd, buf + done, n - done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        done += static_cast<size_t>(r);
+    }
+    return static_cast<ssize_t>(done);
+}
+
+// Read Buffer Arena
+// Reads land in a buffer each worker keeps across files instead of a fresh
+// std::string per file: it only grows (geometrically, page-aligned) and is
+// never zero-filled, since every byte searched was just written by read().
+// A buffer an unusually large unmapped file (a pipe, say) grew past the cap
+// is released once that file is done.
+constexpr size_t READ_BUFFER_ALIGN = 4096;
+constexpr size_t READ_BUFFER_CAP = 16 << 20;
+
+struct ReadBuffer {
+    char* data{nullptr};
+    size_t capacity{0};
+
+    ReadBuffer() = default;
+    ReadBuffer(ReadBuffer&& other) noexcept : data(other.data), capacity(other.capacity) {
+        other.data = nullptr;
+        other.capacity = 0;
+    }
+    ReadBuffer(const ReadBuffer&) = delete;
+    ReadBuffer& operator=(const ReadBuffer&) = delete;
+    ~ReadBuffer() { release(); }
+
+    // Room for at least `n` bytes, keeping the first `keep`; the rest is left uninitialized
+    char* reserve(size_t n, size_t keep = 0) {
+        if (n <= capacity) return data;
+        size_t grown = std::max(n, capacity * 2);
+        grown = (grown + READ_BUFFER_ALIGN - 1) & ~(READ_BUFFER_ALIGN - 1);
+        char* p = static_cast<char*>(::operator new(grown, std::align_val_t(READ_BUFFER_ALIGN)));
+        if (keep) std::memcpy(p, data, keep);
+        release();
+        data = p;
+        capacity = grown;
+        return data;
+    }
+
+    // Drop the memory if a large file grew it past the cap
+    void trim() {
+        if (capacity > READ_BUFFER_CAP) release();
+    }
+
+    void release() {
+        if (data) ::operator delete(data, std::align_val_t(READ_BUFFER_ALIGN));
+        data = nullptr;
+        capacity = 0;
+    }
+};
+
+// Per-Thread Scratch State, reused across every task a worker runs
+struct ThreadContext {
+    ReadBuffer read_buf;
+    ReadBuffer chunk_buf;
+    std::vector<char> dents_buf;
+    OutputBuffer out;
+    HitSet hits;
+    WorkStealingPool* pool{nullptr};    // set for pool workers, which may split large files into part tasks
+    size_t self{0};
+
+    explicit ThreadContext(const Options& opts) : out(opts.tty_output) {}
+};
+
+// Binary Sniffing: a NUL byte in the first block marks a file as binary,
+// checked on bytes that were already read (or mapped) for the search
+constexpr size_t BINARY_SNIFF = 8 * 1024;
+
+inline bool looks_binary(std::string_view data) {
+    return std::memchr(data.data(), '\0', std::min(data.size(), BINARY_SNIFF)) != nullptr;
+}
+
+// Whole-file view: mapped for large regular files, else read into a buffer
+struct FileContents {
+    std::optional<MappedFile> mapped;
+    std::string_view data;
+};
+
+// Load an open file's contents into `out`, reading into `buf` when it is not mapped
+bool load_contents(int fd, ReadBuffer& buf, FileContents& out) {
+    struct stat st;
+    if (::fstat(fd, &st) != 0) return false;
+    bool regular = S_ISREG(st.st_mode);
+    size_t size = regular ? static_cast<size_t>(st.st_size) : 0;
+
+    // Large regular files: match directly against the mapped bytes, no copy
+    if (regular && size >= MMAP_THRESHOLD) {
+        out.mapped.emplace(fd, size);
+        if (out.mapped->ok()) {
+            out.data = out.mapped->view();
+            return true;
+        }
+        out.mapped.reset();
+    }
+
+    // Small files, pipes and special files: buffered read until EOF. A regular
+    // file read up to its stat size is probed with a single byte, so the buffer
+    // only grows if the file did
+    size_t used = 0;
+    size_t want = regular ? size : MMAP_THRESHOLD;
+    while (true) {
+        buf.reserve(used + want, used);
+        ssize_t r = read_full(fd, buf.data + used, want);
+        if (r < 0) return false;
+        used += static_cast<size_t>(r);
+        if (static_cast<size_t>(r) < want) break;
+        if (regular && used == size) {
+            char probe;
+            ssize_t p = read_full(fd, &probe, 1);
+            if (p < 0) return false;
+            if (p == 0) break;
+            buf.reserve(used + 1, used);
+            buf.data[used++] = probe;
+        }
+        want = std::max(want, MMAP_THRESHOLD);
+    }
+    out.data = std::string_view(buf.data, used);
+    return true;
+}
+
+// Streaming Search (bounded memory, for files of any size)
+// Reads fixed-size chunks into the caller's reused buffer and carries the
+// last `overlap` bytes forward, so a match straddling a chunk boundary is
+// still seen whole. Stops reading as soon as `scan` returns true.
+template <typename Scan>
+bool search_stream(int fd, size_t overlap, size_t chunk_size, ReadBuffer& buf, Scan&& scan) {
+    char* base = buf.reserve(overlap + chunk_size);
+
+    size_t carry = 0;
+    while (true) {
+        ssize_t r = read_full(fd, base + carry, chunk_size);
+        if (r < 0) return false;
+
+        size_t used = carry + static_cast<size_t>(r);
+        if (scan(std::string_view(base, used))) return true;
+        if (static_cast<size_t>(r) < chunk_size) return false;
+
+        // Keep the tail that could begin a match finishing in the next chunk
+        carry = std::min(overlap, used);
+        std::memmove(base, base + used - carry, carry);
+    }
+}
+
+// Line Reporter
+// Prints every matching line as path:line:column:text with optional
+// before/after context lines, in the same pass as the search. Newlines are
+// only counted (with the vectorized byte count) up to each match found, so
+// files without matches never pay for line numbering.
+template <typename M>
+bool report_lines(const M& matcher, std::string_view data, const std::string& path,
+                  const Options& opts, OutputBuffer& out) {
+    const char* base = data.data();
+    auto line_end = [&](size_t at) {
+        auto* nl = static_cast<const char*>(std::memchr(base + at, '\n', data.size() - at));
+        return nl ? static_cast<size_t>(nl - base) : data.size();
+    };
+    auto line_start = [&](size_t floor, size_t at) {
+        auto* nl = find_last(base + floor, '\n', at - floor);
+        return nl ? static_cast<size_t>(nl - base) + 1 : floor;
+    };
+
+    size_t line_no = 1, counted = 0;   // `counted` is the start of line `line_no`
+    size_t matches = 0;
+    size_t shown_end = 0, shown_line = 0, after_left = 0;
+    bool any = false;
+
+    for (size_t pos = 0; pos < data.size() && matches < opts.max_count;) {
+        auto m = matcher.find(data, pos);
+        if (!m || m->begin >= data.size()) break;
+        if (!any && !claim_match(opts)) break;
+
+        // Number the matching line, counting only the bytes skipped since the last one
+        size_t ls = line_start(pos, m->begin);
+        size_t le = line_end(m->begin);
+        line_no += count_kernel(base + counted, ls - counted, '\n');
+        counted = ls;
+
+        // Finish the previous match's after-context, then this match's before-context
+        for (; after_left > 0 && shown_end < ls; --after_left) {
+            size_t e = line_end(shown_end);
+            out.add_line(path, ++shown_line, 0, data.substr(shown_end, e - shown_end));
+            shown_end = e + 1;
+        }
+
+        size_t bs = ls, bline = line_no;
+        for (size_t i = 0; i < opts.before && bs > (any ? shown_end : 0); ++i) {
+            bs = line_start(any ? shown_end : 0, bs - 1);
+            --bline;
+        }
+        if (any && bs > shown_end && (opts.before || opts.after)) out.add_separator();
+        while (bs < ls) {
+            size_t e = line_end(bs);
+            out.add_line(path, bline++, 0, data.substr(bs, e - bs));
+            bs = e + 1;
+        }
+
+        out.add_line(path, line_no, m->begin - ls + 1, data.substr(ls, le - ls));
+        any = true;
+        shown_end = le + 1;
+        shown_line = line_no;
+        after_left = opts.after;
+        pos = le + 1;
+        ++matches;
+    }
+
+    for (; after_left > 0 && shown_end < data.size(); --after_left) {
+        size_t e = line_end(shown_end);
+        out.add_line(path, ++shown_line, 0, data.substr(shown_end, e - shown_end));
+        shown_end = e + 1;
+    }
+
+    return any;
+}
+
+// Search a file's whole contents in the selected output mode
+template <typename M>
+bool scan_contents(const Task& task, const M& matcher, const Options& opts,
+                   std::string_view data, ThreadContext& ctx) {
+    if (opts.binary != BinaryMode::Text && looks_binary(data)) {
+        if (opts.binary == BinaryMode::Skip) return false;
+
+        // Binary lines are noise, a matching file gets a single notice instead
+        if (opts.lines) {
+            if (!matcher.search(data) || !claim_match(opts)) return false;
+            ctx.out.add_binary_match(task_path(task).string());
+            return true;
+        }
+    }
+
+    if (opts.lines) return report_lines(matcher, data, task_path(task).string(), opts, ctx.out);
+    if constexpr (M::reports_patterns) {
+        matcher.collect(data, ctx.hits);
+        return !ctx.hits.ids.empty();
+    }
+    return matcher.search(data);
+}
+
+// Large File Splitting
+// A mapped file larger than --split-size is cut into parts of about that
+// size, queued as tasks of their own on the finding worker's deque so idle
+// workers steal them, and merged by whichever part finishes last: the file
+// matches if any part does, and mode 2 gathers keywords part by part in file
+// order. Keyword parts run on past their end by the longest pattern minus
+// one byte; regex parts end at line boundaries instead. --lines output is
+// numbered, ordered and has context, so it keeps to one worker per file.
+struct SplitFile {
+    Task file;
+    FileContents contents;
+    std::vector<size_t> bounds;                 // part i is [bounds[i], bounds[i + 1])
+    std::vector<std::vector<uint32_t>> hits;    // per part, for engines that report patterns
+    std::atomic<size_t> next_part{0};
+    std::atomic<size_t> parts_left{0};
+    std::atomic<bool> matched{false};
+
+    SplitFile(const Task& f, FileContents&& c, std::vector<size_t> b)
+        : file(f), contents(std::move(c)), bounds(std::move(b)), parts_left(bounds.size() - 1) {}
+};
+
+void abandon_part(SplitFile* split) {
+    if (split->parts_left.fetch_sub(1, std::memory_order_acq_rel) == 1) delete split;
+}
+
+// Queue a large mapped file as part tasks, true when it was split (its last part reports it)
+template <typename M>
+bool split_file(const Task& task, const M& matcher, const Options& opts, ThreadContext& ctx, FileContents& contents) {
+    std::string_view data = contents.data;
+    if (!ctx.pool || !opts.split_size || opts.lines || !contents.mapped || data.size() <= opts.split_size) return false;
+    if (!matcher.splittable() || (opts.binary == BinaryMode::Skip && looks_binary(data))) return false;
+
+    std::vector<size_t> bounds{0};
+    for (size_t at = opts.split_size; at < data.size(); at = bounds.back() + opts.split_size) {
+        if constexpr (M::split_at_lines) {
+            // Move the cut to just past the next newline
+            auto* nl = static_cast<const char*>(std::memchr(data.data() + at - 1, '\n', data.size() - at + 1));
+            if (!nl) break;
+            at = static_cast<size_t>(nl - data.data()) + 1;
+            if (at >= data.size()) break;
+        }
+        bounds.push_back(at);
+    }
+    bounds.push_back(data.size());
+    size_t n = bounds.size() - 1;
+    if (n < 2) return false;
+
+    auto* split = new SplitFile(task, std::move(contents), std::move(bounds));
+    split->hits.resize(M::reports_patterns ? n : 0);
+
+    // Every part task holds its own reference to the file's directory
+    std::vector<Task> parts(n, Task{task.dir, task.name, false, split});
+    task.dir->refs.fetch_add(n, std::memory_order_relaxed);
+    ctx.pool->push_all(ctx.self, parts);
+    return true;
+}
+
+// Search Implementation (supports every matcher engine)
+// Returns whether the file matched; line mode prints its own records and
+// engines that report patterns leave the ones hit in `ctx.hits`.
+template <typename M>
+bool search_file(const Task& task, const M& matcher, const Options& opts, ThreadContext& ctx) {
+    UniqueFd file(open_task(task, O_RDONLY));
+    if (file.fd < 0) return false;
+    if constexpr (M::reports_patterns) ctx.hits.reset(matcher.needles.size());
+
+    // Streaming mode keeps memory bounded by the chunk size regardless of file size
+    if constexpr (M::streamable) {
+        if (opts.stream && !opts.lines) {
+            // With --binary skip the first chunk doubles as the sniffed block
+            bool first = true, skipped = false;
+            auto skip = [&](std::string_view chunk) {
+                if (!first) return false;
+                first = false;
+                skipped = opts.binary == BinaryMode::Skip && looks_binary(chunk);
+                return skipped;
+            };
+
+            if constexpr (M::reports_patterns) {
+                // Every pattern has to be seen, so only stop once all of them are
+                search_stream(file.fd, matcher.overlap(), opts.chunk_size, ctx.chunk_buf, [&](std::string_view chunk) {
+                    if (skip(chunk)) return true;
+                    matcher.collect(chunk, ctx.hits);
+                    return ctx.hits.ids.size() == matcher.needles.size();
+                });
+                return !skipped && !ctx.hits.ids.empty();
+            } else {
+                bool found = search_stream(file.fd, matcher.overlap(), opts.chunk_size, ctx.chunk_buf,
+                                           [&](std::string_view chunk) { return skip(chunk) || matcher.search(chunk); });
+                return found && !skipped;
+            }
+        }
+    }
+
+    FileContents contents;
+    if (!load_contents(file.fd, ctx.read_buf, contents)) return false;
+    if (split_file(task, matcher, opts, ctx, contents)) return false;
+
+    bool matched = scan_contents(task, matcher, opts, contents.data, ctx);
+    ctx.read_buf.trim();
+    return matched;
+}
+
+// Expand one directory: subdirectories and regular files become new tasks
+// The entry type comes from readdir's d_type, cached in the directory_entry,
+// so only symlinks (whose target type is unknown) cost a stat here, and
+// workers never stat a path again before opening it.
+void expand_directory(WorkStealingPool& pool, size_t self, const Task& task, const Options& opts) {
+    auto* node = new DirNode(task.dir, task.name);
+    append_path(node->path, task.dir, task.name);
+    node->ignore = opts.ignore ? enter_directory(task.dir->ignore, node->path) : nullptr;
+    std::error_code ec;
+    std::vector<Task> block;
+
+    auto add = [&](const fs::path& p, bool is_dir) {
+        // The entry's name is the tail of the iterator's path, no filename() copy
+        std::string_view name = p.native();
+        name.remove_prefix(name.rfind('/') + 1);
+        if (opts.ignore && ((is_dir && name == ".git") || is_ignored(node->ignore.get(), node->path, name, is_dir))) return;
+        block.push_back(node->add(name, is_dir));
+    };
+
+    fs::directory_iterator it(node->path, fs::directory_options::skip_permission_denied, ec);
+    for (; !ec && it != fs::directory_iterator() && !stop_search.load(std::memory_order_relaxed); it.increment(ec)) {
+        const auto& entry = *it;
+        std::error_code type_ec;
+
+        // Like recursive_directory_iterator, never descend through directory symlinks
+        if (entry.is_symlink(type_ec)) {
+            if (entry.is_regular_file(type_ec)) add(entry.path(), false);
+        } else if (entry.is_directory(type_ec)) {
+            add(entry.path(), true);
+        } else if (entry.is_regular_file(type_ec)) {
+            add(entry.path(), false);
+        }
+    }
+
+    if (ec) {
+        std::lock_guard<std::mutex> lg(out_m);
+        std::cerr << "[walk error]" << fs::path(node->path) << ":" << ec.message() << std::endl;
+    }
+
+    if (adopt(node, block.size())) pool.push_all(self, block);
+}
+
+#ifdef __linux__
+// Raw Directory Walker (Linux getdents64)
+// Reads directory entries in large batches straight from the kernel and
+// opens children relative to the directory descriptor, skipping fs::path
+// construction and full-path resolution for every entry.
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+constexpr size_t DENTS_BUF_SIZE = 256 * 1024;
+
+void expand_directory_raw(WorkStealingPool& pool, size_t self, const Task& task, const Options& opts, std::vector<char>& dents_buf) {
+    int fd = open_task(task, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        // Mirror skip_permission_denied, report anything else
+        if (errno != EACCES) {
+            std::lock_guard<std::mutex> lg(out_m);
+            std::cerr << "[walk error]" << task_path(task) << ":" << std::strerror(errno) << std::endl;
+        }
+        return;
+    }
+
+    auto* node = new DirNode(task.dir, task.name, fd);
+    dents_buf.resize(DENTS_BUF_SIZE);
+    std::vector<Task> block;
+
+    // The full path is only built, once per directory, when ignore files are honored
+    if (opts.ignore) {
+        append_path(node->path, task.dir, task.name);
+        node->ignore = enter_directory(task.dir->ignore, node->path);
+    }
+
+    while (true) {
+        long n = ::syscall(SYS_getdents64, fd, dents_buf.data(), dents_buf.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            std::lock_guard<std::mutex> lg(out_m);
+            std::cerr << "[walk error]" << task_path(task) << ":" << std::strerror(errno) << std::endl;
+            break;
+        }
+        if (n == 0 || stop_search.load(std::memory_order_relaxed)) break;
+
+        for (long off = 0; off < n;) {
+            auto* d = reinterpret_cast<LinuxDirent64*>(dents_buf.data() + off);
+            off += d->d_reclen;
+
+            const char* name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+            // Filesystems without d_type support report DT_UNKNOWN, stat those
+            unsigned char type = d->d_type;
+            struct stat st;
+            if (type == DT_UNKNOWN && ::fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+            }
+
+            // Symlinked files are searched, symlinked directories are not descended into
+            if (type == DT_LNK && ::fstatat(fd, name, &st, 0) == 0 && S_ISREG(st.st_mode)) type = DT_REG;
+
+            if (type != DT_DIR && type != DT_REG) continue;
+            if (opts.ignore && ((type == DT_DIR && std::strcmp(name, ".git") == 0) || is_ignored(node->ignore.get(), node->path, name, type == DT_DIR))) continue;
+            block.push_back(node->add(name, type == DT_DIR));
+        }
+    }
+
+    if (adopt(node, block.size())) pool.push_all(self, block);
+}
+
+// Let the raw walker keep one descriptor open per directory with pending children
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (::getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+#endif
+
+// Queue the path record of a matching file (line mode prints its own)
+template <typename M>
+void report_match(const Task& task, const M& matcher, const Options& opts, ThreadContext& ctx, bool matched) {
+    if (matched && !opts.lines && claim_match(opts)) {
+        if constexpr (M::reports_patterns) ctx.out.add_path(task_path(task).string(), ctx.hits.ids, matcher.needles);
+        else ctx.out.add_path(task_path(task).string());
+    }
+}
+
+// Search one file task and queue its path record (line mode prints its own)
+template <typename M>
+void report_file(const Task& task, const M& matcher, const Options& opts, ThreadContext& ctx) {
+    ++n_files_scanned;
+    bool matched = opts.max_count > 0 && search_file(task, matcher, opts, ctx);
+    report_match(task, matcher, opts, ctx, matched);
+}
+
+// Search one part of a split file; the last part to finish reports the file
+template <typename M>
+void run_part(const Task& task, const M& matcher, const Options& opts, ThreadContext& ctx) {
+    SplitFile& split = *task.split;
+    size_t i = split.next_part++;
+    std::string_view data = split.contents.data;
+    try {
+        if constexpr (M::reports_patterns) {
+            ctx.hits.reset(matcher.needles.size());
+            matcher.collect_part(data, split.bounds[i], split.bounds[i + 1], ctx.hits);
+            split.hits[i] = ctx.hits.ids;
+        } else if (!split.matched.load(std::memory_order_relaxed)) {
+            // Once any part has matched, the rest have nothing left to decide
+            if (matcher.search_part(data, split.bounds[i], split.bounds[i + 1])) split.matched = true;
+        }
+    } catch (std::exception& e) {
+        std::lock_guard<std::mutex> lg(out_m);
+        std::cerr << "[error]" << task_path(task) << ":" << e.what() << std::endl;
+    }
+    if (split.parts_left.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+    std::unique_ptr<SplitFile> last(&split);
+    bool matched = split.matched.load();
+    if constexpr (M::reports_patterns) {
+        ctx.hits.reset(matcher.needles.size());
+        for (auto& part : split.hits) for (uint32_t id : part) ctx.hits.add(id);
+        matched = !ctx.hits.ids.empty();
+    }
+    report_match(split.file, matcher, opts, ctx, matched);
+}
+
+// Expand a directory task with the walker selected by the options
+void expand_task(WorkStealingPool& pool, size_t self, const Task& task, const Options& opts, ThreadContext& ctx) {
+#ifdef __linux__
+    if (opts.raw_walk) expand_directory_raw(pool, self, task, opts, ctx.dents_buf);
+    else expand_directory(pool, self, task, opts);
+#else
+    (void)ctx;
+    expand_directory(pool, self, task, opts);
+#endif
+}
+
+#ifdef MTFKS_IO_URING
+// io_uring Reader (Linux)
+// With --io-uring every worker owns a ring. Instead of opening and reading
+// one file at a time, it takes up to URING_DEPTH file tasks off the pool and
+// keeps all of their openat and read requests in flight, matching each file
+// as soon as its read completes. A file that fills its first read is
+// finished through the blocking path on the descriptor the ring opened. If
+// the kernel has no io_uring (or no openat/read ops), workers quietly keep
+// the blocking path. The rings are driven with raw syscalls, so there is no
+// liburing dependency.
+constexpr unsigned URING_DEPTH = 64;
+constexpr size_t URING_READ_SIZE = MMAP_THRESHOLD;     // larger files get mapped instead
+
+struct UringReader {
+    struct Slot {
+        const Task* task{nullptr};
+        const char* name{nullptr};      // what OPENAT opens, relative to the directory fd if any
+        std::string path;
+        int fd{-1};
+        ReadBuffer buf;
+    };
+
+    UniqueFd ring;
+    bool ok{false};
+    io_uring_params params{};
+    void* sq_ptr{MAP_FAILED};
+    void* cq_ptr{MAP_FAILED};
+    size_t sq_size{0};
+    size_t cq_size{0};
+    io_uring_sqe* sqes{static_cast<io_uring_sqe*>(MAP_FAILED)};
+    unsigned* sq_head{nullptr};
+    unsigned* sq_tail{nullptr};
+    unsigned* sq_mask{nullptr};
+    unsigned* sq_array{nullptr};
+    unsigned* cq_head{nullptr};
+    unsigned* cq_tail{nullptr};
+    unsigned* cq_mask{nullptr};
+    io_uring_cqe* cqes{nullptr};
+    unsigned sqe_tail{0};       // entries filled in so far; the kernel sees them once enter() publishes it
+    unsigned to_submit{0};
+    std::vector<Slot> slots;
+
+    // Set up in the body: `params` is only initialized after `ring`, and the kernel writes into it
+    UringReader() : ring(-1) {
+        ring.fd = static_cast<int>(::syscall(__NR_io_uring_setup, URING_DEPTH, &params));
+        if (ring.fd < 0) {
+            report_failure("io_uring_setup");
+            return;
+        }
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sq_size = cq_size = std::max(sq_size, cq_size);
+
+        sq_ptr = ::mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            report_failure("mmap of the submission ring");
+            return;
+        }
+        cq_ptr = single ? sq_ptr : ::mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            report_failure("mmap of the completion ring");
+            return;
+        }
+        sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) {
+            report_failure("mmap of the submission entries");
+            return;
+        }
+
+        auto* sq = static_cast<char*>(sq_ptr);
+        auto* cq = static_cast<char*>(cq_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        sqe_tail = *sq_tail;
+        ok = true;
+    }
+
+    UringReader(const UringReader&) = delete;
+    UringReader& operator=(const UringReader&) = delete;
+
+    // Say once per run that the blocking path is used instead, every worker would fail alike
+    static void report_failure(const char* what) {
+        static std::atomic<bool> reported{false};
+        if (reported.exchange(true)) return;
+        std::lock_guard<std::mutex> lg(out_m);
+        std::cerr << "[io_uring error]" << what << ":" << std::strerror(errno) << ", using blocking reads" << std::endl;
+    }
+
+    ~UringReader() {
+        if (sqes != MAP_FAILED) ::munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) ::munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED) ::munmap(sq_ptr, sq_size);
+    }
+
+    // Next free submission entry, zeroed; the batch never outgrows the ring
+    io_uring_sqe* next_sqe() {
+        unsigned index = sqe_tail++ & *sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        ++to_submit;
+        return sqe;
+    }
+
+    void queue_open(uint32_t slot) {
+        Slot& s = slots[slot];
+        io_uring_sqe* sqe = next_sqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = s.task->dir->fd >= 0 ? s.task->dir->fd : AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(s.name);
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe->user_data = uint64_t(slot) << 1;
+    }
+
+    void queue_read(uint32_t slot) {
+        Slot& s = slots[slot];
+        io_uring_sqe* sqe = next_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = s.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(s.buf.data);
+        sqe->len = static_cast<uint32_t>(URING_READ_SIZE);
+        sqe->off = 0;       // pread semantics, the file offset stays at 0 for the blocking fallback
+        sqe->user_data = (uint64_t(slot) << 1) | 1;
+    }
+
+    // Submit everything queued and wait for at least one completion. The tail
+    // is published once per batch, after every entry in it is filled in.
+    bool enter() {
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+        while (true) {
+            long r = ::syscall(__NR_io_uring_enter, ring.fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (r >= 0) {
+                to_submit -= static_cast<unsigned>(r);
+                return true;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return false;
+        }
+    }
+
+    // Open and read every task of the batch, calling
+    // complete(task, fd, bytes, whole) as each one finishes: `whole` means
+    // `bytes` is the entire file, otherwise the caller reads from `fd` itself
+    // (fd < 0 when the file could not be opened). Descriptors are closed here.
+    template <typename Complete>
+    void read_all(const std::vector<Task>& batch, Complete&& complete) {
+        if (slots.size() < batch.size()) slots.resize(batch.size());
+        for (uint32_t i = 0; i < batch.size(); ++i) {
+            Slot& s = slots[i];
+            s.task = &batch[i];
+            // Relative names point straight into the directory's arena
+            if (batch[i].dir->fd >= 0) {
+                s.name = task_name(batch[i]);
+            } else {
+                s.path.clear();
+                append_path(s.path, batch[i].dir, batch[i].name);
+                s.name = s.path.c_str();
+            }
+            s.fd = -1;
+            s.buf.reserve(URING_READ_SIZE);
+            queue_open(i);
+        }
+
+        auto finish = [&](Slot& s, std::string_view bytes, bool whole) {
+            complete(*s.task, s.fd, bytes, whole);
+            if (s.fd >= 0) ::close(s.fd);
+            s.fd = -1;
+        };
+
+        size_t left = batch.size();
+        while (left > 0) {
+            if (!enter()) {
+                // The ring broke down, finish whatever is still pending the blocking way
+                for (uint32_t i = 0; i < batch.size(); ++i) {
+                    Slot& s = slots[i];
+                    if (!s.task) continue;
+                    if (s.fd < 0) s.fd = open_task(*s.task, O_RDONLY);
+                    finish(s, {}, false);
+                    s.task = nullptr;
+                }
+                report_failure("io_uring_enter");
+                ok = false;
+                return;
+            }
+
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                const io_uring_cqe& cqe = cqes[head & *cq_mask];
+                Slot& s = slots[cqe.user_data >> 1];
+                int res = cqe.res;
+
+                if (!(cqe.user_data & 1)) {
+                    // openat done: read next, or fall back when the kernel lacks the op
+                    if (res >= 0) {
+                        s.fd = res;
+                        queue_read(static_cast<uint32_t>(cqe.user_data >> 1));
+                        continue;
+                    }
+                    if (res == -EINVAL || res == -EOPNOTSUPP) s.fd = open_task(*s.task, O_RDONLY);
+                    finish(s, {}, false);
+                } else if (res >= 0 && static_cast<size_t>(res) < URING_READ_SIZE) {
+                    finish(s, std::string_view(s.buf.data, static_cast<size_t>(res)), true);
+                } else {
+                    finish(s, {}, false);
+                }
+                s.task = nullptr;
+                --left;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+};
+
+// Gather more file tasks behind `first` without blocking (running any
+// directory or split-file part met on the way with `other`), read them all
+// through the ring handing each to `consume`, and mark the extra tasks done;
+// `first` is marked done by the caller's loop
+template <typename Other, typename Consume>
+void read_batch(WorkStealingPool& pool, size_t self, UringReader& reader, const Task& first,
+                Other&& other, Consume&& consume) {
+    std::vector<Task> batch;
+    batch.push_back(first);
+    while (batch.size() < URING_DEPTH && !stop_search.load(std::memory_order_relaxed)) {
+        auto task = pool.try_pop(self);
+        if (!task) break;
+        if (!task->is_dir && !task->split) {
+            batch.push_back(*task);
+            continue;
+        }
+        try {
+            other(*task);
+        } catch (std::exception& e) {
+            std::lock_guard<std::mutex> lg(out_m);
+            std::cerr << "[error]" << task_path(*task) << ":" << e.what() << std::endl;
+        }
+        pool.done(*task);
+    }
+
+    reader.read_all(batch, [&](const Task& task, int fd, std::string_view bytes, bool whole) {
+        ++n_files_scanned;
+        if (fd < 0) return;
+        try {
+            consume(task, fd, bytes, whole);
+        } catch (std::exception& e) {
+            std::lock_guard<std::mutex> lg(out_m);
+            std::cerr << "[error]" << task_path(task) << ":" << e.what() << std::endl;
+        }
+    });
+
+    for (size_t i = 1; i < batch.size(); ++i) pool.done(batch[i]);
+}
+#endif
+
+// Worker: expands directories and searches files until no task is left
+template <typename M>
+void worker(WorkStealingPool& pool, size_t self, const M& matcher, const Options& opts) {
+    ThreadContext ctx(opts);
+    ctx.pool = &pool;
+    ctx.self = self;
+#ifdef MTFKS_IO_URING
+    // Streaming reads its own chunks, so the ring only serves whole-file reads
+    std::optional<UringReader> reader;
+    if (opts.io_uring && !opts.stream) {
+        reader.emplace();
+        if (!reader->ok) reader.reset();
+    }
+
+    // Match a file the ring read (whole) or opened (the rest is read here)
+    auto consume = [&](const Task& file, int fd, std::string_view bytes, bool whole) {
+        if (opts.max_count == 0) return;
+        if constexpr (M::reports_patterns) ctx.hits.reset(matcher.needles.size());
+        bool matched = false;
+        if (whole) {
+            matched = scan_contents(file, matcher, opts, bytes, ctx);
+        } else {
+            FileContents contents;
+            if (load_contents(fd, ctx.read_buf, contents) && !split_file(file, matcher, opts, ctx, contents)) {
+                matched = scan_contents(file, matcher, opts, contents.data, ctx);
+            }
+            ctx.read_buf.trim();
+        }
+        report_match(file, matcher, opts, ctx, matched);
+    };
+#endif
+
+    // Directories and parts of split files, every task that is not a whole file to read
+    auto run_task = [&](const Task& t) {
+        if (t.is_dir) expand_task(pool, self, t, opts, ctx);
+        else run_part(t, matcher, opts, ctx);
+    };
+
+    Task task;
+    while (pool.next(self, task)) {
+        // Search the file for the keyword/regex
+        try {
+            if (task.is_dir || task.split) {
+                run_task(task);
+            }
+#ifdef MTFKS_IO_URING
+            else if (reader && reader->ok) {
+                read_batch(pool, self, *reader, task, run_task, consume);
+            }
+#endif
+            else {
+                report_file(task, matcher, opts, ctx);
+            }
+        } catch (std::exception& e) {
+            std::lock_guard<std::mutex> lg(out_m);
+            std::cerr << "[error]" << task_path(task) << ":" << e.what() << std::endl;
+        }
+
+        pool.done(task);
+    }
+}
+
+// Reader/Matcher Pipeline
+// With --readers/--matchers the two halves of a worker run in separate
+// pools: readers walk the tree and open and load files (blocking or through
+// io_uring), then hand loaded files in blocks to matcher threads through a
+// bounded BatchQueue. Each pool can be sized for what it waits on, slow
+// storage or an expensive pattern, and the queue bound caps how far readers
+// run ahead (mapped files cost address space, not heap).
+constexpr size_t PIPELINE_QUEUE = 1024;     // loaded files waiting for a matcher
+constexpr size_t PIPELINE_BLOCK = 32;       // files a reader hands over per lock
+
+// A file loaded by a reader; heap-allocated so `contents.data` (which may
+// point into `buf`) stays valid while it moves through the queue. It keeps
+// its directory alive for printing after the reader has marked the task done.
+// Once matched it goes back to the readers, buffer and all, to load another.
+struct LoadedFile {
+    Task task;
+    ReadBuffer buf;
+    FileContents contents;
+
+    LoadedFile() = default;
+    LoadedFile(const LoadedFile&) = delete;
+    LoadedFile& operator=(const LoadedFile&) = delete;
+    ~LoadedFile() { clear(); }
+
+    void hold(const Task& t) {
+        task = t;
+        task.dir->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Drop the file but keep the buffer, unless something other than a small
+    // regular file (a pipe, a file that grew) made it larger than they need
+    void clear() {
+        if (task.dir) release(task.dir);
+        task = Task{};
+        contents.mapped.reset();
+        contents.data = {};
+        if (buf.capacity > 2 * MMAP_THRESHOLD) buf.release();
+    }
+};
+
+using LoadedQueue = BatchQueue<std::unique_ptr<LoadedFile>>;
+
+// Matched files on their way back to the readers; both sides move whole
+// blocks per lock, and at most a queue's worth is kept
+struct LoadedFreeList {
+    std::mutex m;
+    std::vector<std::unique_ptr<LoadedFile>> files;
+
+    // Take back every file of `block`, leaving it empty
+    void put(std::vector<std::unique_ptr<LoadedFile>>& block) {
+        for (auto& file : block) file->clear();
+        {
+            std::lock_guard<std::mutex> lg(m);
+            for (auto& file : block) {
+                if (files.size() >= PIPELINE_QUEUE) break;
+                files.push_back(std::move(file));
+            }
+        }
+        block.clear();
+    }
+
+    // Top `spare` up to a block's worth of recycled files
+    void take(std::vector<std::unique_ptr<LoadedFile>>& spare) {
+        std::lock_guard<std::mutex> lg(m);
+        while (spare.size() < PIPELINE_BLOCK && !files.empty()) {
+            spare.push_back(std::move(files.back()));
+            files.pop_back();
+        }
+    }
+};
+
+void reader_worker(WorkStealingPool& pool, size_t self, LoadedQueue& out, LoadedFreeList& free_list, const Options& opts) {
+    ThreadContext ctx(opts);
+    std::vector<std::unique_ptr<LoadedFile>> block, spare;
+
+    // A recycled file when the matchers have handed any back, a new one otherwise
+    auto load = [&](const Task& file) {
+        if (spare.empty()) free_list.take(spare);
+        std::unique_ptr<LoadedFile> loaded;
+        if (spare.empty()) {
+            loaded = std::make_unique<LoadedFile>();
+        } else {
+            loaded = std::move(spare.back());
+            spare.pop_back();
+        }
+        loaded->hold(file);
+        return loaded;
+    };
+    auto discard = [&](std::unique_ptr<LoadedFile> loaded) {
+        loaded->clear();
+        spare.push_back(std::move(loaded));
+    };
+
+#ifdef MTFKS_IO_URING
+    std::optional<UringReader> reader;
+    if (opts.io_uring) {
+        reader.emplace();
+        if (!reader->ok) reader.reset();
+    }
+
+    // The ring's buffers are reused, so whole reads are copied out; larger files get mapped
+    auto consume = [&](const Task& file, int fd, std::string_view bytes, bool whole) {
+        auto loaded = load(file);
+        if (whole) {
+            if (!bytes.empty()) std::memcpy(loaded->buf.reserve(bytes.size()), bytes.data(), bytes.size());
+            loaded->contents.data = std::string_view(loaded->buf.data, bytes.size());
+        } else if (!load_contents(fd, loaded->buf, loaded->contents)) {
+            return discard(std::move(loaded));
+        }
+        block.push_back(std::move(loaded));
+    };
+#endif
+
+    Task task;
+    while (pool.next(self, task)) {
+        try {
+            if (task.is_dir) {
+                expand_task(pool, self, task, opts, ctx);
+            }
+#ifdef MTFKS_IO_URING
+            else if (reader && reader->ok) {
+                read_batch(pool, self, *reader, task, [&](const Task& dir) { expand_task(pool, self, dir, opts, ctx); }, consume);
+            }
+#endif
+            else {
+                ++n_files_scanned;
+                UniqueFd file(open_task(task, O_RDONLY));
+                if (file.fd >= 0) {
+                    auto loaded = load(task);
+                    if (load_contents(file.fd, loaded->buf, loaded->contents)) block.push_back(std::move(loaded));
+                    else discard(std::move(loaded));
+                }
+            }
+        } catch (std::exception& e) {
+            std::lock_guard<std::mutex> lg(out_m);
+            std::cerr << "[error]" << task_path(task) << ":" << e.what() << std::endl;
+        }
+
+        pool.done(task);
+
+        // Hand over full blocks, and whatever is loaded before this reader may go idle
+        if (block.size() >= PIPELINE_BLOCK || (!block.empty() && pool.queued.load() == 0)) out.push_batch(block);
+    }
+    out.push_batch(block);
+}
+
+template <typename M>
+void matcher_worker(LoadedQueue& in, LoadedFreeList& free_list, const M& matcher, const Options& opts) {
+    ThreadContext ctx(opts);
+    std::vector<std::unique_ptr<LoadedFile>> block;
+
+    while (in.pop_batch(block)) {
+        for (auto& file : block) {
+            // Keep draining after a stop so readers blocked on a full queue can finish
+            if (opts.max_count == 0 || stop_search.load(std::memory_order_relaxed)) continue;
+            try {
+                if constexpr (M::reports_patterns) ctx.hits.reset(matcher.needles.size());
+                bool matched = scan_contents(file->task, matcher, opts, file->contents.data, ctx);
+                report_match(file->task, matcher, opts, ctx, matched);
+            } catch (std::exception& e) {
+                std::lock_guard<std::mutex> lg(out_m);
+                std::cerr << "[error]" << task_path(file->task) << ":" << e.what() << std::endl;
+            }
+        }
+        free_list.put(block);
+    }
+}
+
+#ifdef __linux__
+// Watch Mode (Linux inotify)
+// Every directory under the root is watched before the initial scan starts,
+// so nothing written during the scan is missed. Afterwards only files that
+// are closed after writing or moved into a watched directory are searched
+// again, and new subdirectories are watched and scanned as they appear.
+// With --ignore the same rules as the walk apply: ignored directories (and
+// .git) get no watch, and events for ignored entries are dropped. Rules are
+// read when a directory is first watched, later edits to ignore files only
+// apply to directories that appear after them.
+constexpr uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+struct DirWatcher {
+    struct WatchedDir {
+        fs::path path;
+        std::shared_ptr<const IgnoreRules> ignore;      // rules in effect inside the directory
+    };
+
+    UniqueFd inotify;
+    std::unordered_map<int, WatchedDir> dirs;
+    bool honor_ignore{false};
+
+    explicit DirWatcher(bool ignore) : inotify(::inotify_init1(IN_CLOEXEC)), honor_ignore(ignore) {
+        if (inotify.fd < 0) throw std::runtime_error(std::string("inotify_init1: ") + std::strerror(errno));
+    }
+
+    // Whether an entry of a watched directory is left out under --ignore
+    bool skipped(const WatchedDir& dir, const std::string& name, bool is_dir) const {
+        if (!honor_ignore) return false;
+        return (is_dir && name == ".git") || is_ignored(dir.ignore.get(), dir.path.string(), name, is_dir);
+    }
+
+    // Watch a directory and every real, not ignored subdirectory below it
+    // (`outer` are the rules of its parent), returns the newly visible files
+    std::vector<fs::path> add_tree(const fs::path& root, std::shared_ptr<const IgnoreRules> outer) {
+        std::vector<fs::path> files;
+        std::vector<std::pair<fs::path, std::shared_ptr<const IgnoreRules>>> pending{{root, std::move(outer)}};
+        while (!pending.empty()) {
+            auto [path, parent] = std::move(pending.back());
+            pending.pop_back();
+            WatchedDir dir{path, honor_ignore ? enter_directory(parent, path.string()) : nullptr};
+            add(dir);
+
+            std::error_code ec;
+            fs::directory_iterator it(path, fs::directory_options::skip_permission_denied, ec), end;
+            for (; !ec && it != end; it.increment(ec)) {
+                std::error_code type_ec;
+
+                // Symlinked files are searched, symlinked directories are not descended into
+                bool is_dir = !it->is_symlink(type_ec) && it->is_directory(type_ec);
+                if (!is_dir && !it->is_regular_file(type_ec)) continue;
+                if (skipped(dir, it->path().filename().string(), is_dir)) continue;
+
+                if (is_dir) pending.emplace_back(it->path(), dir.ignore);
+                else files.push_back(it->path());
+            }
+        }
+        return files;
+    }
+
+    void add(const WatchedDir& dir) {
+        int wd = ::inotify_add_watch(inotify.fd, dir.path.c_str(), WATCH_MASK);
+        if (wd >= 0) {
+            dirs[wd] = dir;
+        } else if (errno != EACCES && errno != ENOENT) {
+            std::lock_guard<std::mutex> lg(out_m);
+            std::cerr << "[watch error]" << dir.path << ":" << std::strerror(errno) << std::endl;
+        }
+    }
+};
+
+// Block on inotify events forever, searching each file as it changes
+template <typename M>
+int watch_loop(DirWatcher& watcher, const fs::path& root, std::shared_ptr<const IgnoreRules> root_rules,
+               const M& matcher, const Options& opts) {
+    ThreadContext ctx(opts);
+    ctx.out.line_flush = true;    // someone is waiting on these lines
+
+    auto scan = [&](const fs::path& path) {
+        auto* seed = new DirNode(nullptr, 0);
+        Task task = seed->add(path.native(), false);
+        adopt(seed, 1);
+        try {
+            report_file(task, matcher, opts, ctx);
+        } catch (std::exception& e) {
+            std::lock_guard<std::mutex> lg(out_m);
+            std::cerr << "[error]" << path << ":" << e.what() << std::endl;
+        }
+        release(seed);
+    };
+
+    alignas(struct inotify_event) char events[64 * 1024];
+    while (true) {
+        ssize_t n = ::read(watcher.inotify.fd, events, sizeof(events));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            std::cerr << "[watch error]" << std::strerror(errno) << "\n";
+            return 1;
+        }
+
+        // Files written several times within one batch are only searched once
+        std::vector<fs::path> changed;
+        for (ssize_t off = 0; off < n;) {
+            auto* ev = reinterpret_cast<struct inotify_event*>(events + off);
+            off += static_cast<ssize_t>(sizeof(struct inotify_event) + ev->len);
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were dropped, only a full rescan is safe
+                std::cerr << "[watch error]event queue overflowed, rescanning " << root << "\n";
+                for (auto& path : watcher.add_tree(root, root_rules)) changed.push_back(path);
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                watcher.dirs.erase(ev->wd);
+                continue;
+            }
+
+            auto dir = watcher.dirs.find(ev->wd);
+            if (dir == watcher.dirs.end() || !ev->len) continue;
+            if (watcher.skipped(dir->second, ev->name, ev->mask & IN_ISDIR)) continue;
+            fs::path path = dir->second.path / ev->name;
+
+            if (ev->mask & IN_ISDIR) {
+                // A new or moved-in directory may already hold files
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    for (auto& file : watcher.add_tree(path, dir->second.ignore)) changed.push_back(file);
+                }
+            } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                changed.push_back(path);
+            }
+        }
+
+        std::sort(changed.begin(), changed.end());
+        changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+        for (auto& path : changed) {
+            struct stat st;
+            if (::stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) scan(path);
+            if (stop_search) return 0;
+        }
+    }
+}
+#endif
+
+// Trigram Index
+// `mtfks index <path> <index_dir>` records, for every 3-byte sequence, the
+// sorted list of files containing it. A search with `--index` turns the
+// pattern into required literals, intersects the posting lists of their
+// trigrams, and only reads the candidate files. Postings are delta + varint
+// coded and every segment is memory-mapped at query time.
+//
+// The index directory holds immutable segment files plus a MANIFEST naming
+// the live ones, oldest first. `mtfks update` appends a segment holding only
+// files whose (inode, size, mtime) changed, plus tombstones for deleted
+// ones; the newest record of a path wins. Once segments pile up, they are
+// compacted into one by merging their posting lists, without re-reading files.
+//
+// Segment layout: IndexHeader, IndexFileEntry[n_files], path bytes,
+//                 IndexTrigram[n_trigrams] (sorted), postings
+constexpr char INDEX_MAGIC[8] = {'M', 'T', 'F', 'K', 'S', 'I', 'X', '2'};
+constexpr uint32_t FILE_UNINDEXED = 1;      // binary file: no postings, always a candidate
+constexpr uint32_t FILE_TOMBSTONE = 2;      // deleted since an older segment
+constexpr size_t MAX_SEGMENTS = 8;
+constexpr uint32_t NO_FILE = ~0u;          // new id of a record dropped by compaction
+constexpr uint32_t NO_TRIGRAM = 1u << 24;  // past every 3-byte trigram
+
+struct IndexHeader {
+    char magic[8];
+    uint64_t n_files;
+    uint64_t n_trigrams;
+    uint64_t files_off;
+    uint64_t paths_off;
+    uint64_t tri_off;
+    uint64_t post_off;
+};
+
+struct IndexFileEntry {
+    uint64_t path_off;
+    uint32_t path_len;
+    uint32_t flags;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_ns;
+};
+
+struct IndexTrigram {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t post_off;
+};
+
+// File identity used for change detection
+struct FileStamp {
+    uint64_t inode{0};
+    uint64_t size{0};
+    int64_t mtime_ns{0};
+
+    bool operator==(const FileStamp& o) const { return inode == o.inode && size == o.size && mtime_ns == o.mtime_ns; }
+    bool operator!=(const FileStamp& o) const { return !(*this == o); }
+};
+
+FileStamp stamp_of(const struct stat& st) {
+#ifdef __APPLE__
+    const struct timespec& mtime = st.st_mtimespec;
+#else
+    const struct timespec& mtime = st.st_mtim;
+#endif
+    return FileStamp{static_cast<uint64_t>(st.st_ino), static_cast<uint64_t>(st.st_size),
+                     static_cast<int64_t>(mtime.tv_sec) * 1000000000 + mtime.tv_nsec};
+}
+
+// One file record of a segment being written
+struct IndexRecord {
+    std::string path;
+    uint32_t flags{0};
+    FileStamp stamp;
+};
+
+void put_varint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+// Throws std::runtime_error instead of reading past `end`
+uint64_t get_varint(const uint8_t*& p, const uint8_t* end) {
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7) {
+        if (p == end || shift > 63) throw std::runtime_error("corrupt posting list");
+        uint8_t b = *p++;
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80)) return v;
+    }
+}
+
+// Append one posting list (ascending ids) to `postings` and its table entry to `trigrams`
+void put_postings(uint32_t t, const uint32_t* ids, size_t n, std::vector<IndexTrigram>& trigrams, std::string& postings) {
+    if (!n) return;
+    trigrams.push_back(IndexTrigram{t, static_cast<uint32_t>(n), postings.size()});
+    uint32_t prev = 0;
+    for (size_t i = 0; i < n; ++i) {
+        put_varint(postings, ids[i] - prev);
+        prev = ids[i];
+    }
+}
+
+// Distinct trigrams of a buffer, sorted. `seen` is a 2^24-bit scratch bitmap
+// that is left cleared again, so it can be reused without a memset per file.
+void extract_trigrams(std::string_view data, std::vector<uint64_t>& seen, std::vector<uint32_t>& out) {
+    seen.resize((1u << 24) / 64);
+    out.clear();
+
+    auto* p = reinterpret_cast<const uint8_t*>(data.data());
+    for (size_t i = 0; i + 3 <= data.size(); ++i) {
+        uint32_t t = (uint32_t(p[i]) << 16) | (uint32_t(p[i + 1]) << 8) | p[i + 2];
+        uint64_t bit = uint64_t(1) << (t & 63);
+        if (seen[t >> 6] & bit) continue;
+        seen[t >> 6] |= bit;
+        out.push_back(t);
+    }
+
+    for (uint32_t t : out) seen[t >> 6] = 0;
+    std::sort(out.begin(), out.end());
+}
+
+// Read and trigram every record's file in parallel, filling in flags and stamps.
+// Files that vanished or cannot be read become tombstones.
+std::vector<std::vector<uint32_t>> index_records(const fs::path& root, std::vector<IndexRecord>& records, int n_threads) {
+    std::vector<std::vector<uint32_t>> sets(records.size());
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < std::max(1, n_threads); ++i) {
+        threads.emplace_back([&] {
+            std::vector<uint64_t> seen;
+            ReadBuffer buf;
+            for (size_t id; (id = next++) < records.size();) {
+                auto& rec = records[id];
+                UniqueFd file(::open((root / rec.path).c_str(), O_RDONLY | O_CLOEXEC));
+                struct stat st;
+                FileContents contents;
+                if (file.fd < 0 || ::fstat(file.fd, &st) != 0 || !load_contents(file.fd, buf, contents)) {
+                    rec.flags = FILE_TOMBSTONE;
+                    continue;
+                }
+                rec.stamp = stamp_of(st);
+
+                // Binary files would flood the postings, they are always scanned instead
+                if (looks_binary(contents.data)) {
+                    rec.flags = FILE_UNINDEXED;
+                    continue;
+                }
+                extract_trigrams(contents.data, seen, sets[id]);
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    return sets;
+}
+
+// Posting lists from per-file trigram sets (consumed). The (trigram, id)
+// pairs are bucketed by the trigram's first byte, then each bucket is
+// counting-sorted on the low 16 bits with a small reused table. Pairs are
+// appended in id order and the sort is stable, so every list comes out
+// ascending, and memory follows the number of pairs, not the 2^24 trigrams.
+void build_postings(std::vector<std::vector<uint32_t>>& sets, std::vector<IndexTrigram>& trigrams, std::string& postings) {
+    struct Pair {
+        uint16_t low;
+        uint32_t id;
+    };
+    std::vector<std::vector<Pair>> buckets(256);
+    for (uint32_t id = 0; id < sets.size(); ++id) {
+        for (uint32_t t : sets[id]) buckets[t >> 16].push_back(Pair{static_cast<uint16_t>(t), id});
+        std::vector<uint32_t>().swap(sets[id]);
+    }
+
+    std::vector<uint32_t> starts(65536 + 1), ids;
+    for (uint32_t hi = 0; hi < buckets.size(); ++hi) {
+        auto& pairs = buckets[hi];
+        if (pairs.empty()) continue;
+        std::fill(starts.begin(), starts.end(), 0);
+        for (auto& pair : pairs) ++starts[pair.low + 1];
+        for (size_t low = 0; low < 65536; ++low) starts[low + 1] += starts[low];
+
+        ids.resize(pairs.size());
+        {
+            std::vector<uint32_t> fill(starts.begin(), starts.end() - 1);
+            for (auto& pair : pairs) ids[fill[pair.low]++] = pair.id;
+        }
+        std::vector<Pair>().swap(pairs);
+
+        for (uint32_t low = 0; low < 65536; ++low)
+            put_postings((hi << 16) | low, ids.data() + starts[low], starts[low + 1] - starts[low], trigrams, postings);
+    }
+}
+
+// Write a segment file (throws std::runtime_error on I/O failure)
+void write_segment(const fs::path& p, const std::vector<IndexRecord>& records,
+                   const std::vector<IndexTrigram>& trigrams, const std::string& postings) {
+    std::vector<IndexFileEntry> entries(records.size());
+    std::string paths;
+    for (size_t id = 0; id < records.size(); ++id) {
+        const auto& rec = records[id];
+        entries[id] = IndexFileEntry{paths.size(), static_cast<uint32_t>(rec.path.size()), rec.flags,
+                                     rec.stamp.inode, rec.stamp.size, rec.stamp.mtime_ns};
+        paths += rec.path;
+    }
+
+    IndexHeader hdr{};
+    std::memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.n_files = records.size();
+    hdr.n_trigrams = trigrams.size();
+    hdr.files_off = sizeof(IndexHeader);
+    hdr.paths_off = hdr.files_off + entries.size() * sizeof(IndexFileEntry);
+    hdr.tri_off = (hdr.paths_off + paths.size() + 7) & ~uint64_t(7);
+    hdr.post_off = hdr.tri_off + trigrams.size() * sizeof(IndexTrigram);
+
+    std::ofstream ofs(p, std::ios::binary | std::ios::trunc);
+    if (!ofs) throw std::runtime_error("cannot write " + p.string());
+
+    std::string pad(hdr.tri_off - hdr.paths_off - paths.size(), '\0');
+    ofs.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+    ofs.write(reinterpret_cast<const char*>(entries.data()), static_cast<std::streamsize>(entries.size() * sizeof(IndexFileEntry)));
+    ofs.write(paths.data(), static_cast<std::streamsize>(paths.size()));
+    ofs.write(pad.data(), static_cast<std::streamsize>(pad.size()));
+    ofs.write(reinterpret_cast<const char*>(trigrams.data()), static_cast<std::streamsize>(trigrams.size() * sizeof(IndexTrigram)));
+    ofs.write(postings.data(), static_cast<std::streamsize>(postings.size()));
+    if (!ofs) throw std::runtime_error("write failed for " + p.string());
+}
+
+// Read-only, memory-mapped view of one segment
+struct IndexSegment {
+    std::string name;
+    std::optional<MappedFile> mapped;
+    const IndexHeader* hdr{nullptr};
+    const IndexFileEntry* files{nullptr};
+    const char* paths{nullptr};
+    const IndexTrigram* trigrams{nullptr};
+    const uint8_t* postings{nullptr};
+
+    // Map and validate a segment, throws std::runtime_error if it is unusable
+    IndexSegment(const fs::path& dir, std::string seg_name) : name(std::move(seg_name)) {
+        fs::path p = dir / name;
+        UniqueFd file(::open(p.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat st;
+        if (file.fd < 0 || ::fstat(file.fd, &st) != 0) throw std::runtime_error("cannot open segment " + p.string());
+
+        size_t size = static_cast<size_t>(st.st_size);
+        if (size < sizeof(IndexHeader)) throw std::runtime_error("truncated segment " + p.string());
+        mapped.emplace(file.fd, size);
+        if (!mapped->ok()) throw std::runtime_error("cannot map segment " + p.string());
+
+        const char* base = mapped->view().data();
+        hdr = reinterpret_cast<const IndexHeader*>(base);
+        if (std::memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0)
+            throw std::runtime_error("not an mtfks index segment " + p.string());
+
+        // Every section must lie inside the file
+        auto fits = [&](uint64_t off, uint64_t count, uint64_t elem) { return off <= size && count <= (size - off) / elem; };
+        bool ok = hdr->files_off % alignof(IndexFileEntry) == 0 && hdr->tri_off % alignof(IndexTrigram) == 0 &&
+                  fits(hdr->files_off, hdr->n_files, sizeof(IndexFileEntry)) && hdr->paths_off <= hdr->tri_off &&
+                  fits(hdr->tri_off, hdr->n_trigrams, sizeof(IndexTrigram)) && hdr->post_off <= size;
+        if (!ok) throw std::runtime_error("corrupt index segment " + p.string());
+
+        files = reinterpret_cast<const IndexFileEntry*>(base + hdr->files_off);
+        paths = base + hdr->paths_off;
+        trigrams = reinterpret_cast<const IndexTrigram*>(base + hdr->tri_off);
+        postings = reinterpret_cast<const uint8_t*>(base + hdr->post_off);
+
+        // Each path within the path bytes, each posting list within the postings (an id takes a byte or more)
+        uint64_t paths_size = hdr->tri_off - hdr->paths_off, post_size = size - hdr->post_off;
+        for (uint64_t id = 0; id < hdr->n_files; ++id) {
+            if (files[id].path_off > paths_size || files[id].path_len > paths_size - files[id].path_off)
+                throw std::runtime_error("corrupt index segment " + p.string());
+        }
+        for (uint64_t t = 0; t < hdr->n_trigrams; ++t) {
+            if (trigrams[t].post_off > post_size || trigrams[t].count > post_size - trigrams[t].post_off)
+                throw std::runtime_error("corrupt index segment " + p.string());
+        }
+    }
+
+    std::string_view path(uint32_t id) const { return {paths + files[id].path_off, files[id].path_len}; }
+    FileStamp stamp(uint32_t id) const { return FileStamp{files[id].inode, files[id].size, files[id].mtime_ns}; }
+
+    // Decoded posting list of a trigram entry, throws std::runtime_error unless
+    // its ids are strictly ascending file ids of this segment
+    std::vector<uint32_t> decode(const IndexTrigram& e) const {
+        std::vector<uint32_t> ids(e.count);
+        const uint8_t* p = postings + e.post_off;
+        const uint8_t* end = reinterpret_cast<const uint8_t*>(mapped->view().data() + mapped->view().size());
+        uint64_t id = 0;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            uint64_t delta = get_varint(p, end);
+            if ((i > 0 && delta == 0) || delta >= hdr->n_files - id) throw std::runtime_error("corrupt posting list");
+            ids[i] = static_cast<uint32_t>(id += delta);
+        }
+        return ids;
+    }
+
+    // Posting list of a trigram (empty when no file in this segment contains it)
+    std::vector<uint32_t> lookup(uint32_t t) const {
+        const IndexTrigram* end = trigrams + hdr->n_trigrams;
+        const IndexTrigram* it = std::lower_bound(trigrams, end, t, [](const IndexTrigram& e, uint32_t v) { return e.trigram < v; });
+        if (it == end || it->trigram != t) return {};
+        return decode(*it);
+    }
+
+    // Files that may contain every literal of a group, nullopt if the group cannot narrow anything
+    std::optional<std::vector<uint32_t>> lookup_group(const std::vector<std::string>& literals) const {
+        std::vector<uint32_t> keys;
+        for (auto& lit : literals) {
+            for (size_t i = 0; i + 3 <= lit.size(); ++i) {
+                auto* q = reinterpret_cast<const uint8_t*>(lit.data() + i);
+                keys.push_back((uint32_t(q[0]) << 16) | (uint32_t(q[1]) << 8) | q[2]);
+            }
+        }
+        if (keys.empty()) return std::nullopt;
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        // Intersect the shortest lists first so the working set shrinks fastest
+        std::vector<std::vector<uint32_t>> lists;
+        for (uint32_t t : keys) lists.push_back(lookup(t));
+        std::sort(lists.begin(), lists.end(), [](auto& a, auto& b) { return a.size() < b.size(); });
+
+        std::vector<uint32_t> result = std::move(lists[0]), tmp;
+        for (size_t i = 1; i < lists.size() && !result.empty(); ++i) {
+            tmp.clear();
+            std::set_intersection(result.begin(), result.end(), lists[i].begin(), lists[i].end(), std::back_inserter(tmp));
+            result.swap(tmp);
+        }
+        return result;
+    }
+};
+
+// Every segment named by an index directory's MANIFEST, with the newest
+// record of each path marked live
+struct TrigramIndex {
+    fs::path dir;
+    fs::path root;      // canonical path of the indexed tree, from the MANIFEST
+    std::vector<std::unique_ptr<IndexSegment>> segments;
+    std::vector<std::vector<bool>> live;
+    size_t n_live{0};
+    size_t n_dead{0};
+
+    // Load an index directory, throws std::runtime_error if it is unusable
+    explicit TrigramIndex(const fs::path& index_dir) : dir(index_dir) {
+        std::ifstream manifest(dir / "MANIFEST");
+        std::string header;
+        if (!manifest || !std::getline(manifest, header) || header != "mtfks-index 2")
+            throw std::runtime_error("not an mtfks index directory " + dir.string());
+        std::string root_line;
+        if (!std::getline(manifest, root_line) || root_line.rfind("root ", 0) != 0)
+            throw std::runtime_error("index " + dir.string() + " records no root, rebuild it with `mtfks index`");
+        root = root_line.substr(5);
+        for (std::string name; std::getline(manifest, name);) {
+            if (!name.empty()) segments.push_back(std::make_unique<IndexSegment>(dir, name));
+        }
+
+        // Newest segment first: the first record seen for a path is its current one
+        live.resize(segments.size());
+        std::unordered_set<std::string_view> seen;
+        for (size_t s = segments.size(); s-- > 0;) {
+            const auto& seg = *segments[s];
+            live[s].assign(seg.hdr->n_files, false);
+            for (uint32_t id = 0; id < seg.hdr->n_files; ++id) {
+                bool newest = seen.insert(seg.path(id)).second;
+                live[s][id] = newest && !(seg.files[id].flags & FILE_TOMBSTONE);
+                if (live[s][id]) ++n_live;
+                else ++n_dead;
+            }
+        }
+    }
+
+    // Prefix of the indexed paths below `search_root` ("" for the indexed root
+    // itself), throws if the index does not cover it
+    std::string subtree(const fs::path& search_root) const {
+        fs::path rel = fs::canonical(search_root).lexically_relative(root);
+        if (rel.empty() || *rel.begin() == "..")
+            throw std::runtime_error("index " + dir.string() + " was built for " + root.string() + ", not " + search_root.string());
+        return rel == "." ? std::string() : rel.string() + "/";
+    }
+
+    // Paths, relative to the subtree `prefix`, of the live files below it that
+    // may match a query: every unindexed file, and every file whose (inode,
+    // size, mtime) no longer matches its record, since its postings may be
+    // out of date
+    std::vector<std::string> candidates(const IndexQuery& query, const std::string& prefix) const {
+        std::vector<std::string> result;
+        for (size_t s = 0; s < segments.size(); ++s) {
+            const auto& seg = *segments[s];
+            std::vector<uint32_t> ids;
+            bool all = !query;
+            if (query) {
+                std::vector<uint32_t> tmp;
+                for (auto& group : *query) {
+                    auto hit = seg.lookup_group(group);
+                    if (!hit) {
+                        all = true;
+                        break;
+                    }
+                    tmp.clear();
+                    std::set_union(ids.begin(), ids.end(), hit->begin(), hit->end(), std::back_inserter(tmp));
+                    ids.swap(tmp);
+                }
+            }
+
+            // `ids` is ascending, so it is walked alongside every file id
+            size_t k = 0;
+            for (uint32_t id = 0; id < seg.hdr->n_files; ++id) {
+                bool hit = k < ids.size() && ids[k] == id;
+                if (hit) ++k;
+                if (!live[s][id] || seg.path(id).compare(0, prefix.size(), prefix) != 0) continue;
+                if (hit || all || (seg.files[id].flags & FILE_UNINDEXED) || changed(root, seg, id))
+                    result.emplace_back(seg.path(id).substr(prefix.size()));
+            }
+        }
+        return result;
+    }
+
+    // Whether a file was modified since it was indexed; a vanished file has nothing to search
+    static bool changed(const fs::path& root, const IndexSegment& seg, uint32_t id) {
+        struct stat st;
+        if (::stat((root / seg.path(id)).c_str(), &st) != 0) return false;
+        return stamp_of(st) != seg.stamp(id);
+    }
+};
+
+// Atomically point the MANIFEST at a new segment list, then drop unlisted segment files
+void commit_manifest(const fs::path& dir, const fs::path& root, const std::vector<std::string>& names) {
+    fs::path tmp = dir / "MANIFEST.tmp";
+    {
+        std::ofstream ofs(tmp, std::ios::trunc);
+        ofs << "mtfks-index 2\n";
+        ofs << "root " << root.string() << "\n";
+        for (auto& name : names) ofs << name << "\n";
+        if (!ofs) throw std::runtime_error("cannot write " + tmp.string());
+    }
+    fs::rename(tmp, dir / "MANIFEST");
+
+    std::error_code ec;
+    for (auto& entry : fs::directory_iterator(dir, ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind("seg-", 0) == 0 && std::find(names.begin(), names.end(), name) == names.end())
+            fs::remove(entry.path(), ec);
+    }
+}
+
+// Next unused segment file name in an index directory
+std::string next_segment_name(const fs::path& dir) {
+    unsigned long long n = 0;
+    std::error_code ec;
+    for (auto& entry : fs::directory_iterator(dir, ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind("seg-", 0) == 0) n = std::max(n, std::strtoull(name.c_str() + 4, nullptr, 10) + 1);
+    }
+    return "seg-" + std::to_string(n) + ".idx";
+}
+
+// Relative paths (and current stamps) of the regular files under root, skipping the index itself
+std::vector<std::pair<std::string, FileStamp>> list_index_files(const fs::path& root, const fs::path& index_dir) {
+    std::vector<std::pair<std::string, FileStamp>> files;
+    std::error_code ec;
+    fs::path index_abs = fs::absolute(index_dir, ec).lexically_normal();
+    try {
+        fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied), end;
+        for (; it != end; ++it) {
+            std::error_code type_ec;
+            if (it->is_directory(type_ec) && fs::absolute(it->path(), type_ec).lexically_normal() == index_abs) {
+                it.disable_recursion_pending();
+                continue;
+            }
+            struct stat st;
+            if (::stat(it->path().c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            files.emplace_back(it->path().lexically_relative(root).string(), stamp_of(st));
+        }
+    } catch (std::exception& e) {
+        std::cerr << "[walk error]" << e.what() << "\n";
+    }
+    return files;
+}
+
+// Merge every segment into one holding only live records: posting lists are
+// remapped to the new file ids segment by segment, no file is read again
+void compact_index(const fs::path& index_dir) {
+    TrigramIndex index(index_dir);
+
+    // New ids in (segment, id) order keep every merged posting list ascending
+    std::vector<IndexRecord> records;
+    std::vector<std::vector<uint32_t>> remap(index.segments.size());
+    for (size_t s = 0; s < index.segments.size(); ++s) {
+        const auto& seg = *index.segments[s];
+        remap[s].assign(seg.hdr->n_files, NO_FILE);
+        for (uint32_t id = 0; id < seg.hdr->n_files; ++id) {
+            if (!index.live[s][id]) continue;
+            remap[s][id] = static_cast<uint32_t>(records.size());
+            records.push_back(IndexRecord{std::string(seg.path(id)), seg.files[id].flags, seg.stamp(id)});
+        }
+    }
+
+    // K-way walk over the sorted trigram tables
+    std::vector<IndexTrigram> trigrams;
+    std::string postings;
+    std::vector<size_t> pos(index.segments.size(), 0);
+    std::vector<uint32_t> merged;
+    while (true) {
+        uint32_t t = NO_TRIGRAM;
+        for (size_t s = 0; s < index.segments.size(); ++s) {
+            if (pos[s] < index.segments[s]->hdr->n_trigrams) t = std::min(t, index.segments[s]->trigrams[pos[s]].trigram);
+        }
+        if (t == NO_TRIGRAM) break;
+
+        merged.clear();
+        for (size_t s = 0; s < index.segments.size(); ++s) {
+            const auto& seg = *index.segments[s];
+            if (pos[s] >= seg.hdr->n_trigrams || seg.trigrams[pos[s]].trigram != t) continue;
+            for (uint32_t id : seg.decode(seg.trigrams[pos[s]++])) {
+                if (remap[s][id] != NO_FILE) merged.push_back(remap[s][id]);
+            }
+        }
+        put_postings(t, merged.data(), merged.size(), trigrams, postings);
+    }
+
+    std::string name = next_segment_name(index_dir);
+    write_segment(index_dir / name, records, trigrams, postings);
+    index.segments.clear();
+    commit_manifest(index_dir, index.root, {name});
+}
+
+// Build a fresh single-segment index for `root` in `index_dir`
+int build_index(const fs::path& root, const fs::path& index_dir, int n_threads) {
+    auto t0 = std::chrono::steady_clock::now();
+    try {
+        fs::create_directories(index_dir);
+
+        std::vector<IndexRecord> records;
+        for (auto& [path, stamp] : list_index_files(root, index_dir)) records.push_back(IndexRecord{path, 0, stamp});
+        auto sets = index_records(root, records, n_threads);
+
+        std::vector<IndexTrigram> trigrams;
+        std::string postings;
+        build_postings(sets, trigrams, postings);
+
+        std::string name = next_segment_name(index_dir);
+        write_segment(index_dir / name, records, trigrams, postings);
+        commit_manifest(index_dir, fs::canonical(root), {name});
+
+        auto t1 = std::chrono::steady_clock::now();
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count();
+        std::cout << "Indexed " << records.size() << " files (" << trigrams.size() << " trigrams, "
+                  << postings.size() << " posting bytes) in " << ms << "ms.\n";
+    } catch (std::exception& e) {
+        std::cerr << "[index error]" << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+// Re-index only new or changed files, tombstone deleted ones, compact when due
+int update_index(const fs::path& root, const fs::path& index_dir, int n_threads) {
+    auto t0 = std::chrono::steady_clock::now();
+    try {
+        std::vector<std::string> names;
+        std::vector<IndexRecord> records;
+        size_t n_live = 0, n_dead = 0, n_deleted = 0;
+        fs::path indexed_root;
+        {
+            TrigramIndex index(index_dir);
+            if (!index.subtree(root).empty())
+                throw std::runtime_error("index " + index_dir.string() + " was built for " + index.root.string() + ", not " + root.string());
+            indexed_root = index.root;
+            for (auto& seg : index.segments) names.push_back(seg->name);
+
+            // Current stamp of every live path
+            std::unordered_map<std::string, FileStamp> known;
+            for (size_t s = 0; s < index.segments.size(); ++s) {
+                for (uint32_t id = 0; id < index.segments[s]->hdr->n_files; ++id) {
+                    if (index.live[s][id]) known.emplace(index.segments[s]->path(id), index.segments[s]->stamp(id));
+                }
+            }
+
+            for (auto& [path, stamp] : list_index_files(root, index_dir)) {
+                auto it = known.find(path);
+                if (it == known.end() || it->second != stamp) records.push_back(IndexRecord{path, 0, stamp});
+                if (it != known.end()) known.erase(it);
+            }
+            for (auto& [path, stamp] : known) {
+                records.push_back(IndexRecord{path, FILE_TOMBSTONE, stamp});
+                ++n_deleted;
+            }
+
+            n_live = index.n_live;
+            n_dead = index.n_dead;
+        }
+
+        size_t n_changed = records.size() - n_deleted;
+        if (!records.empty()) {
+            // Only changed files are read, tombstones go after them with no postings
+            std::vector<IndexRecord> changed, deleted;
+            for (auto& rec : records) (rec.flags & FILE_TOMBSTONE ? deleted : changed).push_back(std::move(rec));
+            auto sets = index_records(root, changed, n_threads);
+            for (auto& rec : deleted) {
+                changed.push_back(std::move(rec));
+                sets.emplace_back();
+            }
+
+            std::vector<IndexTrigram> trigrams;
+            std::string postings;
+            build_postings(sets, trigrams, postings);
+
+            std::string name = next_segment_name(index_dir);
+            write_segment(index_dir / name, changed, trigrams, postings);
+            names.push_back(name);
+            commit_manifest(index_dir, indexed_root, names);
+            n_dead += n_changed + n_deleted;
+        }
+
+        // Compact once segments pile up or superseded records outweigh live ones
+        bool compacted = false;
+        if (names.size() > MAX_SEGMENTS || n_dead > n_live) {
+            compact_index(index_dir);
+            compacted = true;
+        }
+
+        auto t1 = std::chrono::steady_clock::now();
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count();
+        std::cout << "Updated " << n_changed << " files, removed " << n_deleted << (compacted ? ", compacted" : "")
+                  << " in " << ms << "ms.\n";
+    } catch (std::exception& e) {
+        std::cerr << "[index error]" << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+// Index and Update Subcommands
+int run_index(int argc, char** argv) {
+    std::string command = argv[1];
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " " << command << " <path> <index_dir> [n_threads]\n";
+        return 2;
+    }
+
+    int n_threads = argc >= 5 ? std::stoi(argv[4]) : static_cast<int>(std::thread::hardware_concurrency());
+    if (command == "update") return update_index(argv[2], argv[3], n_threads);
+    return build_index(argv[2], argv[3], n_threads);
+}
+
+// Literal Kernel Benchmark
+// Loads up to 1 GiB of regular files under `root` into one corpus, then
+// counts every occurrence of `needle` with each kernel and reports GB/s.
+int bench_literal(const std::string& needle, const fs::path& root, int reps) {
+    constexpr size_t CORPUS_LIMIT = size_t(1) << 30;
+
+    std::string corpus;
+    try {
+        for (auto const& entry : fs::recursive_directory_iterator(root, fs::directory_options::skip_permission_denied)) {
+            if (corpus.size() >= CORPUS_LIMIT) break;
+            std::error_code ec;
+            if (!entry.is_regular_file(ec)) continue;
+
+            std::ifstream ifs(entry.path(), std::ios::binary);
+            corpus.append(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        }
+    } catch (std::exception& e) {
+        std::cerr << "[walk error]" << e.what() << "\n";
+    }
+
+    if (corpus.empty() || needle.empty()) {
+        std::cerr << "[bench error]empty corpus or needle\n";
+        return 1;
+    }
+    std::cout << "Corpus: " << corpus.size() << " bytes, needle \"" << needle << "\", " << reps << " reps\n";
+
+    for (auto [name, fn] : available_find_kernels()) {
+        size_t hits = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r) {
+            size_t pos = 0;
+            while (pos < corpus.size()) {
+                size_t found = fn(corpus.data() + pos, corpus.size() - pos, needle.data(), needle.size());
+                if (found == std::string_view::npos) break;
+                ++hits;
+                pos += found + 1;
+            }
+        }
+        auto t1 = std::chrono::steady_clock::now();
+
+        double secs = std::chrono::duration<double>(t1 - t0).count();
+        double gbps = static_cast<double>(corpus.size()) * reps / secs / 1e9;
+        std::cout << "  " << name << ": " << gbps << " GB/s (" << hits / reps << " matches)\n";
+    }
+
+    return 0;
+}
+
+// Work Queue Benchmark
+// One producer pushes `items` paths while 1..max_threads consumers drain
+// them, once with per-item push/pop (the old queue's behaviour) and once
+// with block push/pop, reporting million items per second for each.
+double bench_queue_run(int consumers, size_t items, bool batched) {
+    BatchQueue<fs::path> queue(consumers);
+    std::atomic<size_t> drained{0};
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < consumers; ++i) {
+        threads.emplace_back([&] {
+            std::vector<fs::path> batch;
+            size_t n = 0;
+            while (queue.pop_batch(batch, batched ? BatchQueue<fs::path>::MAX_POP : 1)) n += batch.size();
+            drained += n;
+        });
+    }
+
+    {
+        BatchWriter<fs::path> writer(queue);
+        std::vector<fs::path> single;
+        for (size_t i = 0; i < items; ++i) {
+            fs::path p = "src/module/file_" + std::to_string(i) + ".cpp";
+            if (batched) {
+                writer.push(std::move(p));
+            } else {
+                single.push_back(std::move(p));
+                queue.push_batch(single);
+            }
+        }
+    }
+
+    queue.set_finished();
+    for (auto& thread : threads) thread.join();
+    auto t1 = std::chrono::steady_clock::now();
+
+    if (drained.load() != items) std::cerr << "[bench error]lost items\n";
+    return static_cast<double>(items) / std::chrono::duration<double>(t1 - t0).count() / 1e6;
+}
+
+int bench_queue(int max_threads, size_t items) {
+    std::cout << "Queue: " << items << " paths, one producer\n";
+    for (int n = 1; n <= max_threads; n *= 2) {
+        double single = bench_queue_run(n, items, false);
+        double batched = bench_queue_run(n, items, true);
+        std::cout << "  " << n << " consumers: per-item " << single << " M/s, batched " << batched << " M/s\n";
+    }
+    return 0;
+}
+
+// Benchmark Subcommand
+int run_bench(int argc, char** argv) {
+    if (argc >= 5 && std::string(argv[2]) == "literal") {
+        int reps = argc >= 6 ? std::max(1, std::stoi(argv[5])) : 5;
+        return bench_literal(argv[3], argv[4], reps);
+    }
+    if (argc >= 3 && std::string(argv[2]) == "queue") {
+        int max_threads = argc >= 4 ? std::max(1, std::stoi(argv[3])) : 64;
+        size_t items = argc >= 5 ? std::stoull(argv[4]) : 1000000;
+        return bench_queue(max_threads, items);
+    }
+
+    std::cerr << "Usage: " << argv[0] << " bench literal <keyword> <path> [reps]\n";
+    std::cerr << "       " << argv[0] << " bench queue [max_threads] [items]\n";
+    return 2;
+}
+
+// Print the command line help
+void print_usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " [search] <keyword|regex> <path> <n_threads> <mode> [options]\n";
+    std::cerr << "       " << argv0 << " index <path> <index_dir> [n_threads]\n";
+    std::cerr << "       " << argv0 << " update <path> <index_dir> [n_threads]\n";
+    std::cerr << "       " << argv0 << " bench literal <keyword> <path> [reps]\n";
+    std::cerr << "       " << argv0 << " bench queue [max_threads] [items]\n";
+    std::cerr << "mode: 0 = plain keyword, 1 = regex, 2 = keywords from file (one per line)\n";
+    std::cerr << "options:\n";
+    std::cerr << "  --stream          read files in fixed-size chunks (modes 0 and 2)\n";
+    std::cerr << "  --chunk-size N    chunk size for --stream, K/M/G suffixes allowed (default 1M)\n";
+    std::cerr << "  --split-size N    search mapped files larger than N in parallel parts of N bytes (default 64M, 0 = off)\n";
+    std::cerr << "  --raw-walk        walk with getdents64 and fd-relative opens (Linux)\n";
+    std::cerr << "  --io-uring        keep many file opens/reads in flight per worker with io_uring (Linux)\n";
+    std::cerr << "  --readers N       load files on N threads and hand them to the matcher threads\n";
+    std::cerr << "  --matchers N      search loaded files on N threads (either defaults to n_threads)\n";
+    std::cerr << "  --index DIR       only read files the trigram index says may match\n";
+    std::cerr << "  --watch           after the scan, keep searching files as they are written (Linux)\n";
+    std::cerr << "  -m, --max-count N print at most N matching lines per file\n";
+    std::cerr << "  --max-total N     stop the whole search after N matching files\n";
+    std::cerr << "  --ignore          skip files matched by .gitignore/.ignore files, and .git directories\n";
+    std::cerr << "  --ignore-file F   also skip files matched by the patterns in F (implies --ignore)\n";
+    std::cerr << "  --binary MODE     files with a NUL in their first 8 KiB: text (default), skip or report\n";
+    std::cerr << "  -n, --lines       print path:line:column:text for every matching line\n";
+    std::cerr << "  -B, --before N    print N lines of context before each matching line\n";
+    std::cerr << "  -A, --after N     print N lines of context after each matching line\n";
+    std::cerr << "  -C, --context N   print N lines of context on both sides\n";
+}
+
+// Main Driver Program
+int main(int argc, char** argv) {
+    // Subcommands, an explicit `search` lets a pattern share a subcommand's name
+    std::string command = argc > 1 ? argv[1] : "";
+    if (command == "bench") return run_bench(argc, argv);
+    if (command == "index" || command == "update") return run_index(argc, argv);
+    if (command == "search") {
+        argv[1] = argv[0];
+        ++argv;
+        --argc;
+    }
+
+    // Handle arguments
+    if (argc < 5) {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    fs::path root = argv[2];
+    int num_threads = std::stoi(argv[3]);
+    int mode = std::stoi(argv[4]);
+
+    Options opts;
+    try {
+        opts = parse_options(argc, argv, 5);
+    } catch (std::exception& e) {
+        std::cerr << "[usage error]" << e.what() << "\n";
+        print_usage(argv[0]);
+        return 2;
+    }
+    opts.tty_output = ::isatty(STDOUT_FILENO);
+
+    if (num_threads <= 0) num_threads = 1;
+
+    // Either pool size left out of a pipelined run takes <n_threads>
+    bool pipelined = opts.readers || opts.matchers;
+    if (pipelined) {
+        if (!opts.readers) opts.readers = num_threads;
+        if (!opts.matchers) opts.matchers = num_threads;
+    }
+    size_t n_walkers = pipelined ? opts.readers : num_threads;
+
+    // Build the matcher once up front, an invalid pattern aborts the run
+    std::optional<Matcher> matcher;
+    try {
+        matcher = make_matcher(argv[1], mode);
+    } catch (std::exception& e) {
+        std::cerr << "[pattern error]" << e.what() << "\n";
+        return 2;
+    }
+
+    // Seed the pool with the root directory, or only the index's candidate files, start the timer
+    auto t0 = std::chrono::steady_clock::now();
+    WorkStealingPool pool(n_walkers);
+    auto roots = std::make_unique<DirNode>(nullptr, 0);
+    std::vector<Task> seed;
+    if (opts.index_path.empty()) {
+        // A custom ignore file sits below every .gitignore/.ignore found in the tree
+        std::shared_ptr<IgnoreRules> rules;
+        if (!opts.ignore_file.empty()) {
+            rules = std::make_shared<IgnoreRules>();
+            rules->base = root.string();
+            if (!rules->load(opts.ignore_file)) {
+                std::cerr << "[usage error]cannot read ignore file " << opts.ignore_file << "\n";
+                return 2;
+            }
+        }
+        roots->ignore = rules;
+        seed.push_back(roots->add(root.native(), true));
+    } else {
+        try {
+            TrigramIndex index(opts.index_path);
+            IndexQuery query = std::visit([](const auto& m) { return m.index_query(); }, *matcher);
+            for (auto& path : index.candidates(query, index.subtree(root))) seed.push_back(roots->add((root / path).native(), false));
+        } catch (std::exception& e) {
+            std::cerr << "[index error]" << e.what() << "\n";
+            return 2;
+        }
+    }
+#ifdef __linux__
+    if (opts.raw_walk) raise_fd_limit();
+
+    // Watches go in before the scan starts so no write falls between the two
+    std::optional<DirWatcher> watcher;
+    std::shared_ptr<const IgnoreRules> root_rules = roots->ignore;
+    if (opts.watch) {
+        try {
+            watcher.emplace(opts.ignore);
+            watcher->add_tree(root, root_rules);
+        } catch (std::exception& e) {
+            std::cerr << "[watch error]" << e.what() << "\n";
+            return 2;
+        }
+    }
+#endif
+    if (adopt(roots.release(), seed.size())) pool.push_all(0, seed);
+
+    // Launch the workers specialized for the selected engine
+    std::vector<std::thread> threads;
+    if (!pipelined) {
+        std::visit([&](const auto& m) {
+            using M = std::decay_t<decltype(m)>;
+            for (int i = 0; i < num_threads; ++i)
+                threads.emplace_back(worker<M>, std::ref(pool), i, std::cref(m), std::cref(opts));
+        }, *matcher);
+
+        // All tasks completed, end the timer, join all threads too
+        for (auto& thread : threads) thread.join();
+    } else {
+        // Matchers drain the queue until every reader has finished loading
+        LoadedQueue loaded(opts.matchers, PIPELINE_QUEUE);
+        LoadedFreeList free_list;
+        std::vector<std::thread> matchers;
+        std::visit([&](const auto& m) {
+            using M = std::decay_t<decltype(m)>;
+            for (size_t i = 0; i < opts.matchers; ++i)
+                matchers.emplace_back(matcher_worker<M>, std::ref(loaded), std::ref(free_list), std::cref(m), std::cref(opts));
+        }, *matcher);
+        for (size_t i = 0; i < opts.readers; ++i)
+            threads.emplace_back(reader_worker, std::ref(pool), i, std::ref(loaded), std::ref(free_list), std::cref(opts));
+
+        for (auto& thread : threads) thread.join();
+        loaded.set_finished();
+        for (auto& thread : matchers) thread.join();
+    }
+
+    auto t1 = std::chrono::steady_clock::now();
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1-t0).count();
+    std::cout << "\nScanned " << n_files_scanned.load() << " files in " << ms <<"ms.\n";
+
+#ifdef __linux__
+    if (watcher && !stop_search) {
+        std::cout << "Watching " << watcher->dirs.size() << " directories for changes." << std::endl;
+        return std::visit([&](const auto& m) { return watch_loop(*watcher, root, root_rules, m, opts); }, *matcher);
+    }
+#endif
     return 0;
 }
\ No newline at end of file